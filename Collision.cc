@@ -0,0 +1,639 @@
+#include "Collision.hh"
+#include "cstring"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#define PACK_X86
+#endif
+
+#define NORMAL_RUN (256)
+
+void PackClear(TriPack &pack)
+{
+    memset(&pack, 0, sizeof(TriPack));
+}
+
+void PackTriangle(TriPack &pack, const Tri &tri)
+{
+    Int k = pack.count++;
+    pack.nx[k] = tri.N.x;
+    pack.ny[k] = tri.N.y;
+    pack.nz[k] = tri.N.z;
+    pack.d[k]  = -(tri.N.x*tri.vertices[0].x + tri.N.y*tri.vertices[0].y + tri.N.z*tri.vertices[0].z);
+    pack.x0[k] = tri.vertices[0].x;  pack.z0[k] = tri.vertices[0].z;
+    pack.x1[k] = tri.vertices[1].x;  pack.z1[k] = tri.vertices[1].z;
+    pack.x2[k] = tri.vertices[2].x;  pack.z2[k] = tri.vertices[2].z;
+    pack.orient[k] = (tri.vertices[0].x - tri.vertices[2].x) * (tri.vertices[1].z - tri.vertices[2].z)
+                     - (tri.vertices[0].z - tri.vertices[2].z) * (tri.vertices[1].x - tri.vertices[2].x);
+}
+
+
+namespace
+{
+
+// Scalar fallback, one lane at a time.
+
+inline bool lane_inside(const TriPack &p, Int k, Float Ix, Float Iz)
+{
+    Float ABIor = (p.x0[k] - Ix) * (p.z1[k] - Iz) - (p.z0[k] - Iz) * (p.x1[k] - Ix);
+    Float BCIor = (p.x1[k] - Ix) * (p.z2[k] - Iz) - (p.z1[k] - Iz) * (p.x2[k] - Ix);
+    Float CAIor = (p.x2[k] - Ix) * (p.z0[k] - Iz) - (p.z2[k] - Iz) * (p.x0[k] - Ix);
+    if( p.orient[k] >= 0.0f && (ABIor < 0.0f  || BCIor < 0.0f || CAIor < 0.0f) )   return false;
+    if( p.orient[k] < 0.0f && (ABIor >= 0.0f  || BCIor >= 0.0f || CAIor >= 0.0f) ) return false;
+    return true;
+}
+
+Int segment_scalar(const TriPack &p, const Coord &P, const Coord &Q, Float *lambda)
+{
+    Float Vx = Q.x - P.x, Vy = Q.y - P.y, Vz = Q.z - P.z;
+    Int mask = 0;
+    for(Int k = 0; k < p.count; k++)
+    {
+        Float NV = p.nx[k]*Vx + p.ny[k]*Vy + p.nz[k]*Vz;
+        if(NV == 0.0f) continue;
+        Float l = -(p.nx[k]*P.x + p.ny[k]*P.y + p.nz[k]*P.z + p.d[k]) / NV;
+        lambda[k] = l;
+        if(l < 0.0f || l > 1.0f) continue;
+        if(lane_inside(p, k, P.x + l*Vx, P.z + l*Vz)) mask |= 1 << k;
+    }
+    return mask;
+}
+
+Int sphere_scalar(const TriPack &p, const Coord &P, Float radius, Coord *center)
+{
+    Int mask = 0;
+    for(Int k = 0; k < p.count; k++)
+    {
+        Float Vx = (P.x + radius*(-p.nx[k])) - P.x;
+        Float Vy = (P.y + radius*(-p.ny[k])) - P.y;
+        Float Vz = (P.z + radius*(-p.nz[k])) - P.z;
+        Float l = -(p.nx[k]*P.x + p.ny[k]*P.y + p.nz[k]*P.z + p.d[k]) / (p.nx[k]*Vx + p.ny[k]*Vy + p.nz[k]*Vz);
+        if(l > 1.0f) continue;
+        Float Ix = P.x + l*Vx, Iy = P.y + l*Vy, Iz = P.z + l*Vz;
+        if(!lane_inside(p, k, Ix, Iz)) continue;
+        Float factor = sqrt( (radius*radius)/(p.nx[k]*p.nx[k] + p.ny[k]*p.ny[k] + p.nz[k]*p.nz[k]) );
+        center[k].x = Ix + p.nx[k]*factor;
+        center[k].y = Iy + p.ny[k]*factor;
+        center[k].z = Iz + p.nz[k]*factor;
+        mask |= 1 << k;
+    }
+    return mask;
+}
+
+inline size_t grid_index(const HeightGrid &g, Int x, Int z)
+{
+    Int t = (z >> g.tile_shift)*g.tiles_x + (x >> g.tile_shift);
+    Int m = (1 << g.tile_shift) - 1;
+    return ((size_t)t << (2*g.tile_shift)) + ((z & m) << g.tile_shift) + (x & m);
+}
+
+void heights_scalar(const HeightGrid &g, const Float *x, const Float *z, Float *y, Int count)
+{
+    const Float last = (Float)(g.size-1);
+    for(Int k = 0; k < count; k++)
+    {
+        Float fx = std::max(0.0f, std::min(x[k], last));
+        Float fz = std::max(0.0f, std::min(z[k], last));
+        Int cx = std::min((Int)fx, g.size-2), cz = std::min((Int)fz, g.size-2);
+        Float u = fx - (Float)cx, v = fz - (Float)cz;
+
+        Float h00 = g.data[grid_index(g, cx,   cz  )], h10 = g.data[grid_index(g, cx+1, cz  )];
+        Float h01 = g.data[grid_index(g, cx,   cz+1)], h11 = g.data[grid_index(g, cx+1, cz+1)];
+        // Even triangle below the diagonal, odd one above; see ComputeTriangle.
+        Float h;
+        if(u + v <= 1.0f) h = h00 + u*(h10 - h00) + v*(h01 - h00);
+        else              h = h11 + (1.0f - u)*(h01 - h11) + (1.0f - v)*(h10 - h11);
+        y[k] = h * (1.0f/FACTOR);
+    }
+}
+
+// Heights of row z from x-1 to x+count, clamped to the map; copied a tile
+// span at a time.
+inline void grid_line(const HeightGrid &g, Int x, Int z, Int count, GLUbyte *line)
+{
+    z = std::max(0, std::min(z, g.size-1));
+    for(Int k = 0; k < count + 2; )
+    {
+        Int vx = x - 1 + k;
+        if(vx < 0 || vx >= g.size)
+        {
+            line[k++] = g.data[grid_index(g, std::max(0, std::min(vx, g.size-1)), z)];
+            continue;
+        }
+        Int run = std::min(std::min(count + 2 - k, g.size - vx), (((vx >> g.tile_shift) + 1) << g.tile_shift) - vx);
+        memcpy(line + k, g.data + grid_index(g, vx, z), run);
+        k += run;
+    }
+}
+
+inline Int round_normal(Float v)
+{
+    return (Int)(v + (v < 0.0f ? -0.5f : 0.5f));
+}
+
+// Vertex i of a run sits at mid[i+1], between rows up and down.
+void normals_scalar(const GLUbyte *up, const GLUbyte *mid, const GLUbyte *down, Int count, Normal *out)
+{
+    for(Int i = 0; i < count; i++)
+    {
+        Float dx = (Float)((Int)mid[i] - (Int)mid[i+2]);
+        Float dz = (Float)((Int)up[i+1] - (Int)down[i+1]);
+        Float s = 127.0f / std::sqrt(dx*dx + dz*dz + 4.0f*FACTOR*FACTOR);
+        out[i].x = (GLbyte)round_normal(dx*s);
+        out[i].y = (GLbyte)round_normal((2.0f*FACTOR)*s);
+        out[i].z = (GLbyte)round_normal(dz*s);
+        out[i].w = 0;
+    }
+}
+
+// The corner furthest along each plane's normal is picked per plane, so
+// the per-box work is one dot product per plane.
+struct CullPlane
+{
+    Float a, b, c, d;
+    const Float *x, *y, *z;
+};
+
+inline void cull_planes(const BoxSet &boxes, const Float planes[6][4], CullPlane *out)
+{
+    for(Int p = 0; p < 6; p++)
+    {
+        out[p].a = planes[p][0];  out[p].b = planes[p][1];
+        out[p].c = planes[p][2];  out[p].d = planes[p][3];
+        out[p].x = out[p].a >= 0.0f ? boxes.x1.data() : boxes.x0.data();
+        out[p].y = out[p].b >= 0.0f ? boxes.y1.data() : boxes.y0.data();
+        out[p].z = out[p].c >= 0.0f ? boxes.z1.data() : boxes.z0.data();
+    }
+}
+
+Int cull_scalar(const CullPlane *planes, Int begin, Int end, Int *visible)
+{
+    Int n = 0;
+    for(Int k = begin; k < end; k++)
+    {
+        bool inside = true;
+        for(Int p = 0; p < 6 && inside; p++)
+        {
+            const CullPlane &q = planes[p];
+            inside = q.a*q.x[k] + q.b*q.y[k] + q.c*q.z[k] + q.d >= 0.0f;
+        }
+        if(inside) visible[n++] = k;
+    }
+    return n;
+}
+
+
+#ifdef PACK_X86
+
+// SSE2 is part of the x86-64 baseline; 8 lanes are done as two halves.
+// Only separate multiplies and adds are used so the results round exactly
+// like the scalar code.
+
+inline __m128 sse_outside(const TriPack &p, Int o, __m128 Ix, __m128 Iz)
+{
+    __m128 x0 = _mm_loadu_ps(p.x0 + o), z0 = _mm_loadu_ps(p.z0 + o);
+    __m128 x1 = _mm_loadu_ps(p.x1 + o), z1 = _mm_loadu_ps(p.z1 + o);
+    __m128 x2 = _mm_loadu_ps(p.x2 + o), z2 = _mm_loadu_ps(p.z2 + o);
+    __m128 AB = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(x0, Ix), _mm_sub_ps(z1, Iz)), _mm_mul_ps(_mm_sub_ps(z0, Iz), _mm_sub_ps(x1, Ix)));
+    __m128 BC = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(x1, Ix), _mm_sub_ps(z2, Iz)), _mm_mul_ps(_mm_sub_ps(z1, Iz), _mm_sub_ps(x2, Ix)));
+    __m128 CA = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(x2, Ix), _mm_sub_ps(z0, Iz)), _mm_mul_ps(_mm_sub_ps(z2, Iz), _mm_sub_ps(x0, Ix)));
+    __m128 zero = _mm_setzero_ps();
+    __m128 orient = _mm_loadu_ps(p.orient + o);
+    __m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(AB, zero), _mm_cmplt_ps(BC, zero)), _mm_cmplt_ps(CA, zero));
+    __m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpge_ps(AB, zero), _mm_cmpge_ps(BC, zero)), _mm_cmpge_ps(CA, zero));
+    return _mm_or_ps(_mm_and_ps(_mm_cmpge_ps(orient, zero), neg), _mm_and_ps(_mm_cmplt_ps(orient, zero), pos));
+}
+
+inline __m128 sse_dot_plane(const TriPack &p, Int o, __m128 X, __m128 Y, __m128 Z)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p.nx + o), X), _mm_mul_ps(_mm_loadu_ps(p.ny + o), Y)),
+                      _mm_mul_ps(_mm_loadu_ps(p.nz + o), Z));
+}
+
+Int segment_sse(const TriPack &p, const Coord &P, const Coord &Q, Float *lambda)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 Px = _mm_set1_ps(P.x), Py = _mm_set1_ps(P.y), Pz = _mm_set1_ps(P.z);
+    __m128 Vx = _mm_set1_ps(Q.x - P.x), Vy = _mm_set1_ps(Q.y - P.y), Vz = _mm_set1_ps(Q.z - P.z);
+    Int mask = 0;
+    for(Int o = 0; o < p.count; o += 4)
+    {
+        __m128 NV = sse_dot_plane(p, o, Vx, Vy, Vz);
+        __m128 NP = _mm_add_ps(sse_dot_plane(p, o, Px, Py, Pz), _mm_loadu_ps(p.d + o));
+        __m128 l  = _mm_div_ps(_mm_xor_ps(NP, sign), NV);
+        _mm_storeu_ps(lambda + o, l);
+
+        __m128 Ix = _mm_add_ps(Px, _mm_mul_ps(l, Vx));
+        __m128 Iz = _mm_add_ps(Pz, _mm_mul_ps(l, Vz));
+        __m128 out = _mm_or_ps(_mm_cmplt_ps(l, _mm_setzero_ps()), _mm_cmpgt_ps(l, _mm_set1_ps(1.0f)));
+        out = _mm_or_ps(out, sse_outside(p, o, Ix, Iz));
+        __m128 hit = _mm_andnot_ps(out, _mm_cmpneq_ps(NV, _mm_setzero_ps()));
+        mask |= _mm_movemask_ps(hit) << o;
+    }
+    return mask & ((1 << p.count) - 1);
+}
+
+Int sphere_sse(const TriPack &p, const Coord &P, Float radius, Coord *center)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 Px = _mm_set1_ps(P.x), Py = _mm_set1_ps(P.y), Pz = _mm_set1_ps(P.z);
+    __m128 r = _mm_set1_ps(radius);
+    __m128 r2 = _mm_set1_ps(radius*radius);
+    Int mask = 0;
+    for(Int o = 0; o < p.count; o += 4)
+    {
+        __m128 nx = _mm_loadu_ps(p.nx + o), ny = _mm_loadu_ps(p.ny + o), nz = _mm_loadu_ps(p.nz + o);
+        __m128 Vx = _mm_sub_ps(_mm_add_ps(Px, _mm_mul_ps(r, _mm_xor_ps(nx, sign))), Px);
+        __m128 Vy = _mm_sub_ps(_mm_add_ps(Py, _mm_mul_ps(r, _mm_xor_ps(ny, sign))), Py);
+        __m128 Vz = _mm_sub_ps(_mm_add_ps(Pz, _mm_mul_ps(r, _mm_xor_ps(nz, sign))), Pz);
+        __m128 NP = _mm_add_ps(sse_dot_plane(p, o, Px, Py, Pz), _mm_loadu_ps(p.d + o));
+        __m128 l  = _mm_div_ps(_mm_xor_ps(NP, sign), sse_dot_plane(p, o, Vx, Vy, Vz));
+
+        __m128 Ix = _mm_add_ps(Px, _mm_mul_ps(l, Vx));
+        __m128 Iy = _mm_add_ps(Py, _mm_mul_ps(l, Vy));
+        __m128 Iz = _mm_add_ps(Pz, _mm_mul_ps(l, Vz));
+        __m128 out = _mm_or_ps(_mm_cmpgt_ps(l, _mm_set1_ps(1.0f)), sse_outside(p, o, Ix, Iz));
+        Int m = (_mm_movemask_ps(out) ^ 0xf) & ((1 << p.count) - 1) >> o;
+        if(!m) continue;
+
+        __m128 factor = _mm_sqrt_ps(_mm_div_ps(r2, sse_dot_plane(p, o, nx, ny, nz)));
+        Float cx[4], cy[4], cz[4];
+        _mm_storeu_ps(cx, _mm_add_ps(Ix, _mm_mul_ps(nx, factor)));
+        _mm_storeu_ps(cy, _mm_add_ps(Iy, _mm_mul_ps(ny, factor)));
+        _mm_storeu_ps(cz, _mm_add_ps(Iz, _mm_mul_ps(nz, factor)));
+        for(Int k = 0; k < 4; k++)
+        {
+            if(!(m & (1 << k))) continue;
+            center[o+k].x = cx[k];
+            center[o+k].y = cy[k];
+            center[o+k].z = cz[k];
+        }
+        mask |= m << o;
+    }
+    return mask;
+}
+
+
+Int cull_sse(const CullPlane *planes, Int count, Int *visible)
+{
+    Int n = 0, k = 0;
+    for(; k + 4 <= count; k += 4)
+    {
+        __m128 out = _mm_setzero_ps();
+        for(Int p = 0; p < 6; p++)
+        {
+            const CullPlane &q = planes[p];
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(q.a), _mm_loadu_ps(q.x + k)),
+                                                        _mm_mul_ps(_mm_set1_ps(q.b), _mm_loadu_ps(q.y + k))),
+                                             _mm_mul_ps(_mm_set1_ps(q.c), _mm_loadu_ps(q.z + k))),
+                                  _mm_set1_ps(q.d));
+            out = _mm_or_ps(out, _mm_cmplt_ps(d, _mm_setzero_ps()));
+        }
+        for(Int in = _mm_movemask_ps(out) ^ 0xf; in; in &= in - 1)
+            visible[n++] = k + __builtin_ctz(in);
+    }
+    return n + cull_scalar(planes, k, count, visible + n);
+}
+
+
+inline __m128i sse_round_normal(__m128 v)
+{
+    __m128 half = _mm_or_ps(_mm_and_ps(v, _mm_set1_ps(-0.0f)), _mm_set1_ps(0.5f));
+    return _mm_and_si128(_mm_cvttps_epi32(_mm_add_ps(v, half)), _mm_set1_epi32(0xff));
+}
+
+// Four vertices from their x and z height differences, packed as Normal.
+inline __m128i sse_normal(__m128i ix, __m128i iz)
+{
+    __m128 dx = _mm_cvtepi32_ps(ix), dz = _mm_cvtepi32_ps(iz);
+    __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dz, dz)), _mm_set1_ps(4.0f*FACTOR*FACTOR)));
+    __m128 s = _mm_div_ps(_mm_set1_ps(127.0f), len);
+    __m128i x = sse_round_normal(_mm_mul_ps(dx, s));
+    __m128i y = sse_round_normal(_mm_mul_ps(_mm_set1_ps(2.0f*FACTOR), s));
+    __m128i z = sse_round_normal(_mm_mul_ps(dz, s));
+    return _mm_or_si128(_mm_or_si128(x, _mm_slli_epi32(y, 8)), _mm_slli_epi32(z, 16));
+}
+
+void normals_sse(const GLUbyte *up, const GLUbyte *mid, const GLUbyte *down, Int count, Normal *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    Int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(mid + i)), b = _mm_loadu_si128((const __m128i*)(mid + i + 2));
+        __m128i c = _mm_loadu_si128((const __m128i*)(up + i + 1)), d = _mm_loadu_si128((const __m128i*)(down + i + 1));
+        // Widen to 16 bits, where the differences fit, then to 32 bits.
+        __m128i dx[2] = { _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                          _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)) };
+        __m128i dz[2] = { _mm_sub_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero)),
+                          _mm_sub_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero)) };
+        for(Int h = 0; h < 2; h++)
+        {
+            __m128i lo_x = _mm_srai_epi32(_mm_unpacklo_epi16(zero, dx[h]), 16), hi_x = _mm_srai_epi32(_mm_unpackhi_epi16(zero, dx[h]), 16);
+            __m128i lo_z = _mm_srai_epi32(_mm_unpacklo_epi16(zero, dz[h]), 16), hi_z = _mm_srai_epi32(_mm_unpackhi_epi16(zero, dz[h]), 16);
+            _mm_storeu_si128((__m128i*)(out + i + h*8),     sse_normal(lo_x, lo_z));
+            _mm_storeu_si128((__m128i*)(out + i + h*8 + 4), sse_normal(hi_x, hi_z));
+        }
+    }
+    normals_scalar(up + i, mid + i, down + i, count - i, out + i);
+}
+
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256 avx_outside(const TriPack &p, __m256 Ix, __m256 Iz)
+{
+    __m256 x0 = _mm256_loadu_ps(p.x0), z0 = _mm256_loadu_ps(p.z0);
+    __m256 x1 = _mm256_loadu_ps(p.x1), z1 = _mm256_loadu_ps(p.z1);
+    __m256 x2 = _mm256_loadu_ps(p.x2), z2 = _mm256_loadu_ps(p.z2);
+    __m256 AB = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(x0, Ix), _mm256_sub_ps(z1, Iz)), _mm256_mul_ps(_mm256_sub_ps(z0, Iz), _mm256_sub_ps(x1, Ix)));
+    __m256 BC = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(x1, Ix), _mm256_sub_ps(z2, Iz)), _mm256_mul_ps(_mm256_sub_ps(z1, Iz), _mm256_sub_ps(x2, Ix)));
+    __m256 CA = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(x2, Ix), _mm256_sub_ps(z0, Iz)), _mm256_mul_ps(_mm256_sub_ps(z2, Iz), _mm256_sub_ps(x0, Ix)));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 orient = _mm256_loadu_ps(p.orient);
+    __m256 neg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(AB, zero, _CMP_LT_OQ), _mm256_cmp_ps(BC, zero, _CMP_LT_OQ)),
+                              _mm256_cmp_ps(CA, zero, _CMP_LT_OQ));
+    __m256 pos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(AB, zero, _CMP_GE_OQ), _mm256_cmp_ps(BC, zero, _CMP_GE_OQ)),
+                              _mm256_cmp_ps(CA, zero, _CMP_GE_OQ));
+    return _mm256_or_ps(_mm256_and_ps(_mm256_cmp_ps(orient, zero, _CMP_GE_OQ), neg),
+                        _mm256_and_ps(_mm256_cmp_ps(orient, zero, _CMP_LT_OQ), pos));
+}
+
+AVX2 inline __m256 avx_dot_plane(const TriPack &p, __m256 X, __m256 Y, __m256 Z)
+{
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p.nx), X), _mm256_mul_ps(_mm256_loadu_ps(p.ny), Y)),
+                         _mm256_mul_ps(_mm256_loadu_ps(p.nz), Z));
+}
+
+AVX2 Int segment_avx2(const TriPack &p, const Coord &P, const Coord &Q, Float *lambda)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 Px = _mm256_set1_ps(P.x), Py = _mm256_set1_ps(P.y), Pz = _mm256_set1_ps(P.z);
+    __m256 Vx = _mm256_set1_ps(Q.x - P.x), Vy = _mm256_set1_ps(Q.y - P.y), Vz = _mm256_set1_ps(Q.z - P.z);
+
+    __m256 NV = avx_dot_plane(p, Vx, Vy, Vz);
+    __m256 NP = _mm256_add_ps(avx_dot_plane(p, Px, Py, Pz), _mm256_loadu_ps(p.d));
+    __m256 l  = _mm256_div_ps(_mm256_xor_ps(NP, sign), NV);
+    _mm256_storeu_ps(lambda, l);
+
+    __m256 Ix = _mm256_add_ps(Px, _mm256_mul_ps(l, Vx));
+    __m256 Iz = _mm256_add_ps(Pz, _mm256_mul_ps(l, Vz));
+    __m256 out = _mm256_or_ps(_mm256_cmp_ps(l, _mm256_setzero_ps(), _CMP_LT_OQ),
+                              _mm256_cmp_ps(l, _mm256_set1_ps(1.0f), _CMP_GT_OQ));
+    out = _mm256_or_ps(out, avx_outside(p, Ix, Iz));
+    __m256 hit = _mm256_andnot_ps(out, _mm256_cmp_ps(NV, _mm256_setzero_ps(), _CMP_NEQ_UQ));
+    return _mm256_movemask_ps(hit) & ((1 << p.count) - 1);
+}
+
+AVX2 Int sphere_avx2(const TriPack &p, const Coord &P, Float radius, Coord *center)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 Px = _mm256_set1_ps(P.x), Py = _mm256_set1_ps(P.y), Pz = _mm256_set1_ps(P.z);
+    __m256 r = _mm256_set1_ps(radius);
+    __m256 nx = _mm256_loadu_ps(p.nx), ny = _mm256_loadu_ps(p.ny), nz = _mm256_loadu_ps(p.nz);
+    __m256 Vx = _mm256_sub_ps(_mm256_add_ps(Px, _mm256_mul_ps(r, _mm256_xor_ps(nx, sign))), Px);
+    __m256 Vy = _mm256_sub_ps(_mm256_add_ps(Py, _mm256_mul_ps(r, _mm256_xor_ps(ny, sign))), Py);
+    __m256 Vz = _mm256_sub_ps(_mm256_add_ps(Pz, _mm256_mul_ps(r, _mm256_xor_ps(nz, sign))), Pz);
+    __m256 NP = _mm256_add_ps(avx_dot_plane(p, Px, Py, Pz), _mm256_loadu_ps(p.d));
+    __m256 l  = _mm256_div_ps(_mm256_xor_ps(NP, sign), avx_dot_plane(p, Vx, Vy, Vz));
+
+    __m256 Ix = _mm256_add_ps(Px, _mm256_mul_ps(l, Vx));
+    __m256 Iy = _mm256_add_ps(Py, _mm256_mul_ps(l, Vy));
+    __m256 Iz = _mm256_add_ps(Pz, _mm256_mul_ps(l, Vz));
+    __m256 out = _mm256_or_ps(_mm256_cmp_ps(l, _mm256_set1_ps(1.0f), _CMP_GT_OQ), avx_outside(p, Ix, Iz));
+    Int mask = (_mm256_movemask_ps(out) ^ 0xff) & ((1 << p.count) - 1);
+    if(!mask) return 0;
+
+    __m256 factor = _mm256_sqrt_ps(_mm256_div_ps(_mm256_set1_ps(radius*radius), avx_dot_plane(p, nx, ny, nz)));
+    Float cx[8], cy[8], cz[8];
+    _mm256_storeu_ps(cx, _mm256_add_ps(Ix, _mm256_mul_ps(nx, factor)));
+    _mm256_storeu_ps(cy, _mm256_add_ps(Iy, _mm256_mul_ps(ny, factor)));
+    _mm256_storeu_ps(cz, _mm256_add_ps(Iz, _mm256_mul_ps(nz, factor)));
+    for(Int k = 0; k < 8; k++)
+    {
+        if(!(mask & (1 << k))) continue;
+        center[k].x = cx[k];
+        center[k].y = cy[k];
+        center[k].z = cz[k];
+    }
+    return mask;
+}
+
+AVX2 Int cull_avx2(const CullPlane *planes, Int count, Int *visible)
+{
+    Int n = 0, k = 0;
+    for(; k + 8 <= count; k += 8)
+    {
+        __m256 out = _mm256_setzero_ps();
+        for(Int p = 0; p < 6; p++)
+        {
+            const CullPlane &q = planes[p];
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(q.a), _mm256_loadu_ps(q.x + k)),
+                                                                 _mm256_mul_ps(_mm256_set1_ps(q.b), _mm256_loadu_ps(q.y + k))),
+                                                   _mm256_mul_ps(_mm256_set1_ps(q.c), _mm256_loadu_ps(q.z + k))),
+                                     _mm256_set1_ps(q.d));
+            out = _mm256_or_ps(out, _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_LT_OQ));
+        }
+        for(Int in = _mm256_movemask_ps(out) ^ 0xff; in; in &= in - 1)
+            visible[n++] = k + __builtin_ctz(in);
+    }
+    return n + cull_scalar(planes, k, count, visible + n);
+}
+
+AVX2 inline __m256i avx_grid_index(const HeightGrid &g, __m256i x, __m256i z)
+{
+    __m128i shift = _mm_cvtsi32_si128(g.tile_shift), shift2 = _mm_cvtsi32_si128(2*g.tile_shift);
+    __m256i m = _mm256_set1_epi32((1 << g.tile_shift) - 1);
+    __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srl_epi32(z, shift), _mm256_set1_epi32(g.tiles_x)),
+                                 _mm256_srl_epi32(x, shift));
+    return _mm256_add_epi32(_mm256_add_epi32(_mm256_sll_epi32(t, shift2),
+                                             _mm256_sll_epi32(_mm256_and_si256(z, m), shift)),
+                            _mm256_and_si256(x, m));
+}
+
+// Gathers the aligned word holding each height byte, so no lane reads
+// outside the map even at its last vertex.
+AVX2 inline __m256 avx_gather_height(const GLUbyte *data, __m256i index)
+{
+    __m256i word = _mm256_i32gather_epi32((const int*)data, _mm256_srli_epi32(index, 2), 4);
+    __m256i bits = _mm256_slli_epi32(_mm256_and_si256(index, _mm256_set1_epi32(3)), 3);
+    return _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srlv_epi32(word, bits), _mm256_set1_epi32(0xff)));
+}
+
+AVX2 void heights_avx2(const HeightGrid &g, const Float *x, const Float *z, Float *y, Int count)
+{
+    // 32-bit gather offsets cover maps up to 2^31 vertices.
+    if((size_t)g.size*g.size > 0x7fffffffu) { heights_scalar(g, x, z, y, count); return; }
+
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256 last = _mm256_set1_ps((Float)(g.size-1));
+    const __m256i cell = _mm256_set1_epi32(g.size-2), step = _mm256_set1_epi32(1);
+    Int k = 0;
+    for(; k + 8 <= count; k += 8)
+    {
+        __m256 fx = _mm256_max_ps(zero, _mm256_min_ps(_mm256_loadu_ps(x + k), last));
+        __m256 fz = _mm256_max_ps(zero, _mm256_min_ps(_mm256_loadu_ps(z + k), last));
+        __m256i cx = _mm256_min_epi32(_mm256_cvttps_epi32(fx), cell);
+        __m256i cz = _mm256_min_epi32(_mm256_cvttps_epi32(fz), cell);
+        __m256 u = _mm256_sub_ps(fx, _mm256_cvtepi32_ps(cx));
+        __m256 v = _mm256_sub_ps(fz, _mm256_cvtepi32_ps(cz));
+        __m256i cx1 = _mm256_add_epi32(cx, step), cz1 = _mm256_add_epi32(cz, step);
+
+        __m256 h00 = avx_gather_height(g.data, avx_grid_index(g, cx,  cz ));
+        __m256 h10 = avx_gather_height(g.data, avx_grid_index(g, cx1, cz ));
+        __m256 h01 = avx_gather_height(g.data, avx_grid_index(g, cx,  cz1));
+        __m256 h11 = avx_gather_height(g.data, avx_grid_index(g, cx1, cz1));
+
+        __m256 even = _mm256_add_ps(_mm256_add_ps(h00, _mm256_mul_ps(u, _mm256_sub_ps(h10, h00))),
+                                    _mm256_mul_ps(v, _mm256_sub_ps(h01, h00)));
+        __m256 odd  = _mm256_add_ps(_mm256_add_ps(h11, _mm256_mul_ps(_mm256_sub_ps(one, u), _mm256_sub_ps(h01, h11))),
+                                    _mm256_mul_ps(_mm256_sub_ps(one, v), _mm256_sub_ps(h10, h11)));
+        __m256 below = _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ);
+        __m256 h = _mm256_blendv_ps(odd, even, below);
+        _mm256_storeu_ps(y + k, _mm256_mul_ps(h, _mm256_set1_ps(1.0f/FACTOR)));
+    }
+    heights_scalar(g, x + k, z + k, y + k, count - k);
+}
+
+
+AVX2 inline __m256i avx_round_normal(__m256 v)
+{
+    __m256 half = _mm256_or_ps(_mm256_and_ps(v, _mm256_set1_ps(-0.0f)), _mm256_set1_ps(0.5f));
+    return _mm256_and_si256(_mm256_cvttps_epi32(_mm256_add_ps(v, half)), _mm256_set1_epi32(0xff));
+}
+
+AVX2 inline __m256i avx_normal(const GLUbyte *a, const GLUbyte *b, const GLUbyte *c, const GLUbyte *d)
+{
+    __m256 dx = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)a)),
+                                                    _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)b))));
+    __m256 dz = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)c)),
+                                                    _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)d))));
+    __m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dz, dz)),
+                                              _mm256_set1_ps(4.0f*FACTOR*FACTOR)));
+    __m256 s = _mm256_div_ps(_mm256_set1_ps(127.0f), len);
+    __m256i x = avx_round_normal(_mm256_mul_ps(dx, s));
+    __m256i y = avx_round_normal(_mm256_mul_ps(_mm256_set1_ps(2.0f*FACTOR), s));
+    __m256i z = avx_round_normal(_mm256_mul_ps(dz, s));
+    return _mm256_or_si256(_mm256_or_si256(x, _mm256_slli_epi32(y, 8)), _mm256_slli_epi32(z, 16));
+}
+
+AVX2 void normals_avx2(const GLUbyte *up, const GLUbyte *mid, const GLUbyte *down, Int count, Normal *out)
+{
+    Int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        _mm256_storeu_si256((__m256i*)(out + i),     avx_normal(mid + i,     mid + i + 2,  up + i + 1, down + i + 1));
+        _mm256_storeu_si256((__m256i*)(out + i + 8), avx_normal(mid + i + 8, mid + i + 10, up + i + 9, down + i + 9));
+    }
+    normals_scalar(up + i, mid + i, down + i, count - i, out + i);
+}
+
+#endif
+
+
+Int cull_all(const CullPlane *planes, Int count, Int *visible)
+{
+    return cull_scalar(planes, 0, count, visible);
+}
+
+struct PackKernels
+{
+    Int (*segment)(const TriPack&, const Coord&, const Coord&, Float*);
+    Int (*sphere)(const TriPack&, const Coord&, Float, Coord*);
+    void (*heights)(const HeightGrid&, const Float*, const Float*, Float*, Int);
+    Int (*cull)(const CullPlane*, Int, Int*);
+    void (*normals)(const GLUbyte*, const GLUbyte*, const GLUbyte*, Int, Normal*);
+    const Char *name;
+
+    PackKernels()
+    {
+        if(!Select("avx2") && !Select("sse2")) Select("scalar");
+    }
+
+    bool Select(const Char *set)
+    {
+        if(strcmp(set, "scalar") == 0)
+        {
+            segment = segment_scalar;
+            sphere  = sphere_scalar;
+            heights = heights_scalar;
+            cull    = cull_all;
+            normals = normals_scalar;
+            name    = "scalar";
+            return true;
+        }
+#ifdef PACK_X86
+        // SSE2 has no gather, so its heights stay scalar.
+        if(strcmp(set, "sse2") == 0)
+        {
+            segment = segment_sse;
+            sphere  = sphere_sse;
+            heights = heights_scalar;
+            cull    = cull_sse;
+            normals = normals_sse;
+            name    = "sse2";
+            return true;
+        }
+        if(strcmp(set, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+        {
+            segment = segment_avx2;
+            sphere  = sphere_avx2;
+            heights = heights_avx2;
+            cull    = cull_avx2;
+            normals = normals_avx2;
+            name    = "avx2";
+            return true;
+        }
+#endif
+        return false;
+    }
+};
+
+PackKernels kernels;
+
+}
+
+Int PackSegment(const TriPack &pack, const Coord &P, const Coord &Q, Float *lambda)
+{
+    return kernels.segment(pack, P, Q, lambda);
+}
+
+Int PackSphere(const TriPack &pack, const Coord &P, Float radius, Coord *center)
+{
+    return kernels.sphere(pack, P, radius, center);
+}
+
+void GridHeights(const HeightGrid &grid, const Float *x, const Float *z, Float *y, Int count)
+{
+    kernels.heights(grid, x, z, y, count);
+}
+
+void GridNormals(const HeightGrid &grid, Int x, Int z, Int count, Normal *out)
+{
+    GLUbyte up[NORMAL_RUN + 2], mid[NORMAL_RUN + 2], down[NORMAL_RUN + 2];
+    for(Int k = 0; k < count; k += NORMAL_RUN)
+    {
+        Int n = std::min(NORMAL_RUN, count - k);
+        grid_line(grid, x + k, z - 1, n, up);
+        grid_line(grid, x + k, z,     n, mid);
+        grid_line(grid, x + k, z + 1, n, down);
+        kernels.normals(up, mid, down, n, out + k);
+    }
+}
+
+Int CullBoxes(const BoxSet &boxes, Int count, const Float planes[6][4], Int *visible)
+{
+    CullPlane q[6];
+    cull_planes(boxes, planes, q);
+    return kernels.cull(q, count, visible);
+}
+
+bool SetPackKernels(const Char *name)
+{
+    return kernels.Select(name);
+}
+
+const Char* PackKernelName()
+{
+    return kernels.name;
+}
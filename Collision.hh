@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Terrain.hh"
+
+#define PACK_WIDTH (8)
+
+// Up to PACK_WIDTH terrain triangles laid out lane by lane: the plane
+// (N, D), the xz corners for the inside test and its orientation term.
+struct TriPack
+{
+	Float nx[PACK_WIDTH], ny[PACK_WIDTH], nz[PACK_WIDTH], d[PACK_WIDTH];
+	Float x0[PACK_WIDTH], z0[PACK_WIDTH];
+	Float x1[PACK_WIDTH], z1[PACK_WIDTH];
+	Float x2[PACK_WIDTH], z2[PACK_WIDTH];
+	Float orient[PACK_WIDTH];
+	Int   count;
+};
+
+void PackClear(TriPack &pack);
+void PackTriangle(TriPack &pack, const Tri &tri);
+
+// Both kernels give, lane for lane, the same answers as the scalar
+// Terrain::CollisionCheck overloads and return the bitmask of hit lanes.
+Int PackSegment(const TriPack &pack, const Coord &P, const Coord &Q, Float *lambda);
+Int PackSphere(const TriPack &pack, const Coord &P, Float radius, Coord *center);
+
+// A heightmap in the tile layout of Terrain::Index.
+struct HeightGrid
+{
+	const GLUbyte *data;
+	Int size, tile_shift, tiles_x;
+};
+
+// Interpolated ground heights of count points on the terrain triangles,
+// clamped to the map. The SIMD path gathers the cell corners eight points
+// at a time and matches the scalar one bit for bit.
+void GridHeights(const HeightGrid &grid, const Float *x, const Float *z, Float *y, Int count);
+
+// Smooth normals of the count vertices of row z starting at x, from
+// central differences clamped at the map border, as (dx, 2 FACTOR, dz)
+// scaled to 127. The SIMD paths do sixteen vertices per iteration and match
+// the scalar one bit for bit.
+void GridNormals(const HeightGrid &grid, Int x, Int z, Int count, Normal *out);
+
+// Writes the indices of the first count boxes not fully behind any of the
+// six planes (a, b, c, d: ax + by + cz + d >= 0 is inside) and returns how
+// many there are. Each plane is tested against its box corner furthest
+// along the normal, eight boxes at a time.
+Int CullBoxes(const BoxSet &boxes, Int count, const Float planes[6][4], Int *visible);
+
+// Switches every kernel above to the "scalar", "sse2" or "avx2" set; false,
+// with the selection left alone, if the name is unknown or the CPU lacks
+// it. The best set the CPU has is picked at startup.
+bool SetPackKernels(const Char *name);
+const Char* PackKernelName();
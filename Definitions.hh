@@ -4,6 +4,7 @@
 #include "cstdint"
 #include "cmath"
 #include "string"
+#include "vector"
 #include "iostream"
 #include "fstream"
 #include "GL/glew.h"
@@ -0,0 +1,83 @@
+#include "RenderQueue.hh"
+#include "algorithm"
+#include "cstring"
+
+RenderQueue::RenderQueue() : draws(0), changes(0), unsorted(0), pending_changes(0) { }
+
+uint64_t RenderQueue::Key(const DrawItem &item)
+{
+    Float d = std::min(std::max(item.depth, 0.0f), 1.0f);
+    return (uint64_t)(item.program & 0xffff) << 48 |
+           (uint64_t)(item.texture & 0xffff) << 32 |
+           (uint64_t)(item.vao & 0xffff) << 16 |
+           (uint64_t)(d * 65535.0f);
+}
+
+// Binds needed to go from a to b; a null a is the start of a frame.
+static Int transitions(const DrawItem *a, const DrawItem &b)
+{
+    Int n = 0;
+    if(!a || a->program != b.program) n++;
+    if(b.texture && (!a || a->texture != b.texture || a->target != b.target)) n++;
+    if(!a || a->vao != b.vao) n++;
+    return n;
+}
+
+void RenderQueue::Submit(const DrawItem &item, const void *block, GLsizeiptr size)
+{
+    Queued q = {item, blocks.size(), block ? size : 0};
+    if(q.size)
+    {
+        blocks.resize(blocks.size() + q.size);
+        memcpy(&blocks[q.block], block, q.size);
+    }
+    pending_changes += transitions(queued.empty() ? nullptr : &queued.back().item, item);
+    order.push_back(Entry{Key(item), (Int)queued.size()});
+    queued.push_back(q);
+}
+
+void RenderQueue::Flush(Shader &shader, UniformRing *ring)
+{
+    std::sort(order.begin(), order.end());
+
+    draws = order.size();
+    changes = 0;
+    unsorted = pending_changes;
+    glActiveTexture(GL_TEXTURE0);
+    const DrawItem *bound = nullptr;
+    for(const Entry &e : order)
+    {
+        const Queued &q = queued[e.index];
+        const DrawItem &d = q.item;
+        if(!bound || bound->program != d.program)
+        {
+            shader.Activate(d.program);
+            changes++;
+        }
+        if(d.texture && (!bound || bound->texture != d.texture || bound->target != d.target))
+        {
+            glBindTexture(d.target, d.texture);
+            changes++;
+        }
+        if(!bound || bound->vao != d.vao)
+        {
+            glBindVertexArray(d.vao);
+            changes++;
+        }
+        bound = &d;
+
+        if(ring && q.size) ring->Draw(&blocks[q.block], q.size);
+        if(d.type) glDrawElements(d.mode, d.count, d.type, reinterpret_cast<const GLvoid*>(d.first));
+        else glDrawArrays(d.mode, d.first, d.count);
+    }
+    if(bound)
+    {
+        glBindVertexArray(0);
+        shader.Deactivate();
+    }
+
+    queued.clear();
+    order.clear();
+    blocks.clear();
+    pending_changes = 0;
+}
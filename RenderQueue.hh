@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Definitions.hh"
+#include "Shader.hh"
+#include "UniformRing.hh"
+
+// One draw as the queue sees it. With a type, count indices of that type are
+// read from the vertex array's element buffer at byte offset first; with
+// type 0 it is count vertices from vertex first.
+struct DrawItem
+{
+	Int program;    // Shader handle
+	GLUint texture; // on unit 0; 0 leaves the unit as it is
+	GLenum target;
+	GLUint vao;
+	GLenum mode;
+	GLsizei count;
+	GLenum type;
+	GLintptr first;
+	Float depth;    // 0 near to 1 far
+};
+
+// Collects a frame's draws and issues them ordered by a 64-bit key: program,
+// texture and vertex array in the high 48 bits, depth in the low 16. Equal
+// state ends up adjacent, and within it opaque draws go front to back. Binds
+// are only made when the state actually changes; StateChanges() counts them
+// for the last Flush, Unsorted() what submission order would have needed.
+class RenderQueue
+{
+public:
+	RenderQueue();
+
+	static uint64_t Key(const DrawItem &item);
+	// block, if any, is copied and bound to DRAW_BLOCK through the ring.
+	void Submit(const DrawItem &item, const void *block = nullptr, GLsizeiptr size = 0);
+	void Flush(Shader &shader, UniformRing *ring = nullptr);
+
+	Int Draws() const { return draws; }
+	Int StateChanges() const { return changes; }
+	Int Unsorted() const { return unsorted; }
+
+private:
+	struct Queued
+	{
+		DrawItem item;
+		size_t block;
+		GLsizeiptr size;
+	};
+	struct Entry
+	{
+		uint64_t key;
+		Int index;
+		bool operator<(const Entry &o) const { return key != o.key ? key < o.key : index < o.index; }
+	};
+
+	std::vector<Queued> queued;
+	std::vector<Entry> order;
+	std::vector<uint8_t> blocks;
+	Int draws;
+	Int changes;
+	Int unsorted;
+	Int pending_changes;
+};
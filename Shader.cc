@@ -1,7 +1,22 @@
 #include "Shader.hh"
+#include "UniformRing.hh"
+#include "algorithm"
+#include "chrono"
+#include "sstream"
+#include "sys/stat.h"
 
-Shader::Shader(){}
-Shader::~Shader(){}
+// Binary cache files start with this tag and the driver's binary format.
+#define BINARY_MAGIC 0x31425845u // "EXB1"
+
+Shader::Shader() : current_pid(0), cached(0), calls(0), load_time(0), prepared(false), binaries(false), driver_hash(0)
+{
+}
+
+Shader::~Shader()
+{
+    for (Program &p : programs)
+        if (p.name) glDeleteProgram(p.name);
+}
 
 std::string get_file_contents(const Char* filename)
 {
@@ -26,29 +41,394 @@ void load_shader(GLUint shader_obj, Char* const shader_filename)
     glNGetShaderSource(shader_obj, get_file_contents(shader_filename) );
 }
 
-void Shader::Load()
+static GLUint compile_shader(GLenum type, const std::string &source)
+{
+    GLUint shader = glCreateShader(type);
+    glNGetShaderSource(shader, source);
+    glCompileShader(shader);
+
+    GLInt status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        GLInt length = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+        std::string log(length > 0 ? length : 1, '\0');
+        glGetShaderInfoLog(shader, log.size(), nullptr, &log[0]);
+        std::cerr << "Shader: compile failed: " << log.c_str() << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static std::string driver_string()
+{
+    std::string driver;
+    const GLenum names[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+    for (GLenum name : names)
+    {
+        const GLubyte *s = glGetString(name);
+        if (s) driver += reinterpret_cast<const Char*>(s);
+        driver += '\n';
+    }
+    return driver;
+}
+
+void Shader::Prepare(const Char *cache)
+{
+    // Binaries are only worth keeping when the driver can hand them back.
+    GLInt formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    binaries = formats > 0 && cache && *cache;
+    cache_dir = binaries ? cache : "";
+    if (binaries) mkdir(cache, 0755);
+
+    const std::string driver = driver_string();
+    driver_hash = utils::fnv1a(driver.data(), driver.size());
+    prepared = true;
+}
+
+bool Shader::Load(const Char *manifest, const Char *cache)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::ifstream list(manifest);
+    if (!list)
+    {
+        std::cerr << "Shader: can't open manifest " << manifest << std::endl;
+        return false;
+    }
+    std::string base(manifest);
+    base = base.substr(0, base.find_last_of('/') + 1);
+    Prepare(cache);
+
+    bool ok = true;
+    Int pid = 0;
+    cached = 0;
+    std::string line;
+    while (std::getline(list, line))
+    {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream fields(line);
+        std::string vs, fs;
+        if (!(fields >> vs)) continue;
+        if (!(fields >> fs))
+        {
+            std::cerr << "Shader: " << manifest << ": expected two files in \"" << line << "\"" << std::endl;
+            ok = false;
+            continue;
+        }
+        if (pid == static_cast<Int>(manifest_handles.size()))
+        {
+            manifest_handles.push_back(programs.size());
+            programs.push_back(Program{0, {}, {}});
+        }
+        ok = Install(manifest_handles[pid], base + vs, base + fs) && ok;
+        ++pid;
+    }
+
+    std::chrono::duration<Float, std::milli> took = std::chrono::steady_clock::now() - start;
+    load_time = took.count();
+    return ok;
+}
+
+Int Shader::Add(const Char *vertex, const Char *fragment)
+{
+    if (!prepared) Prepare(SHADER_CACHE);
+    Int pid = programs.size();
+    programs.push_back(Program{0, {}, {}});
+    if (Install(pid, vertex, fragment)) return pid;
+    programs.pop_back();
+    return -1;
+}
+
+bool Shader::Install(Int pid, const std::string &vertex_file, const std::string &fragment_file)
+{
+    Program &p = programs[pid];
+    std::string vertex = get_file_contents(vertex_file.c_str());
+    std::string fragment = get_file_contents(fragment_file.c_str());
+    if (vertex.empty() || fragment.empty())
+    {
+        std::cerr << "Shader: can't read " << (vertex.empty() ? vertex_file : fragment_file) << std::endl;
+        return false;
+    }
+
+    std::string binary;
+    if (binaries)
+    {
+        uint64_t key = utils::fnv1a(vertex.data(), vertex.size(), driver_hash);
+        key = utils::fnv1a("\0", 1, key);
+        key = utils::fnv1a(fragment.data(), fragment.size(), key);
+        Char name[17];
+        snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+        binary = cache_dir + "/" + name + ".bin";
+    }
+
+    if (p.name) glDeleteProgram(p.name);
+    p.name = Build(vertex, fragment, binary);
+    Reflect(pid);
+    if (!p.name)
+    {
+        std::cerr << "Shader: program " << pid << " (" << vertex_file << ", " << fragment_file << ") failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Scalars per element of a uniform type, and whether they are read back as
+// integers. Samplers and images are single ints; doubles aren't shadowed.
+static Int uniform_components(GLenum type, bool &integer)
+{
+    integer = false;
+    switch (type)
+    {
+    case GL_FLOAT:             return 1;
+    case GL_FLOAT_VEC2:        return 2;
+    case GL_FLOAT_VEC3:        return 3;
+    case GL_FLOAT_VEC4:        return 4;
+    case GL_FLOAT_MAT2:        return 4;
+    case GL_FLOAT_MAT2x3:      return 6;
+    case GL_FLOAT_MAT2x4:      return 8;
+    case GL_FLOAT_MAT3x2:      return 6;
+    case GL_FLOAT_MAT3:        return 9;
+    case GL_FLOAT_MAT3x4:      return 12;
+    case GL_FLOAT_MAT4x2:      return 8;
+    case GL_FLOAT_MAT4x3:      return 12;
+    case GL_FLOAT_MAT4:        return 16;
+    case GL_DOUBLE:
+    case GL_DOUBLE_VEC2:
+    case GL_DOUBLE_VEC3:
+    case GL_DOUBLE_VEC4:
+    case GL_DOUBLE_MAT2:
+    case GL_DOUBLE_MAT3:
+    case GL_DOUBLE_MAT4:       return 0;
+    }
+    integer = true;
+    switch (type)
+    {
+    case GL_INT_VEC2:
+    case GL_UNSIGNED_INT_VEC2:
+    case GL_BOOL_VEC2:         return 2;
+    case GL_INT_VEC3:
+    case GL_UNSIGNED_INT_VEC3:
+    case GL_BOOL_VEC3:         return 3;
+    case GL_INT_VEC4:
+    case GL_UNSIGNED_INT_VEC4:
+    case GL_BOOL_VEC4:         return 4;
+    }
+    return 1;
+}
+
+void Shader::Reflect(Int pid)
+{
+    std::vector<Uniform> &table = programs[pid].uniforms;
+    std::vector<uint8_t> &shadow = programs[pid].shadow;
+    const GLUint program = programs[pid].name;
+    table.clear();
+    shadow.clear();
+    if (!program) return;
+
+    GLInt active = 0, longest = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &active);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &longest);
+    std::vector<Char> name(longest > 0 ? longest : 1);
+    for (GLInt i = 0; i < active; ++i)
+    {
+        GLsizei length = 0;
+        Uniform u;
+        glGetActiveUniform(program, i, name.size(), &length, &u.count, &u.type, name.data());
+        // Block members have no location; they are set through their buffer.
+        u.location = glGetUniformLocation(program, name.data());
+        if (u.location == -1) continue;
+
+        // The shadow starts from what the program really holds, so GLSL
+        // initializers and binaries from the cache are both honoured.
+        bool integer;
+        Int element = uniform_components(u.type, integer) * 4;
+        u.offset = shadow.size();
+        u.bytes = element * u.count;
+        shadow.resize(shadow.size() + u.bytes);
+
+        u.name = Name(name.data());
+        table.push_back(u);
+
+        // Arrays are reported as "name[0]"; accept the bare name and every
+        // element, each with the location the driver gives it.
+        std::string full(name.data(), length);
+        std::string bare = full;
+        bool array = full.size() > 3 && full.compare(full.size() - 3, 3, "[0]") == 0;
+        if (array)
+        {
+            bare = full.substr(0, full.size() - 3);
+            u.name = Name(bare.c_str());
+            table.push_back(u);
+        }
+        for (GLInt e = 0; e < u.count; ++e)
+        {
+            Uniform v = u;
+            if (e > 0)
+            {
+                std::string item = bare + "[" + std::to_string(e) + "]";
+                v.location = glGetUniformLocation(program, item.c_str());
+                v.name = Name(item.c_str());
+                v.count = u.count - e;
+                v.offset = u.offset + e * element;
+                v.bytes = element * v.count;
+                if (v.location == -1) continue;
+                table.push_back(v);
+            }
+            if (!element) continue;
+            if (integer)
+                glGetUniformiv(program, v.location, reinterpret_cast<GLint*>(&shadow[v.offset]));
+            else
+                glGetUniformfv(program, v.location, reinterpret_cast<GLfloat*>(&shadow[v.offset]));
+        }
+    }
+    // Shared blocks are fed by UniformRing, at fixed binding points.
+    GLUint block = glGetUniformBlockIndex(program, "Frame");
+    if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, FRAME_BLOCK);
+    block = glGetUniformBlockIndex(program, "Draw");
+    if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, DRAW_BLOCK);
+
+    std::sort(table.begin(), table.end());
+    for (size_t i = 1; i < table.size(); ++i)
+        if (table[i].name == table[i - 1].name)
+            std::cerr << "Shader: program " << pid << " has colliding uniform names" << std::endl;
+}
+
+const Shader::Uniform *Shader::Find(uint64_t name) const
+{
+    if (current_pid < 0 || current_pid >= static_cast<Int>(programs.size())) return nullptr;
+    const std::vector<Uniform> &table = programs[current_pid].uniforms;
+    Uniform key;
+    key.name = name;
+    auto it = std::lower_bound(table.begin(), table.end(), key);
+    return it != table.end() && it->name == name ? &*it : nullptr;
+}
+
+GLInt Shader::GetLocation(uint64_t name) const
 {
-    /*
+    const Uniform *u = Find(name);
+    return u ? u->location : -1;
+}
+
+GLUint Shader::Build(const std::string &vertex, const std::string &fragment, const std::string &binary)
+{
+    GLUint program = glCreateProgram();
+    if (!binary.empty() && LoadBinary(program, binary))
+    {
+        ++cached;
+        return program;
+    }
+
+    // A rejected binary leaves the program unlinked, so start clean.
+    glDeleteProgram(program);
+    program = glCreateProgram();
 
-    GLUint shader;
+    GLUint vs = compile_shader(GL_VERTEX_SHADER, vertex);
+    GLUint fs = compile_shader(GL_FRAGMENT_SHADER, fragment);
+    if (!vs || !fs)
+    {
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        glDeleteProgram(program);
+        return 0;
+    }
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    if (!binary.empty())
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    glDetachShader(program, vs);
+    glDetachShader(program, fs);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
 
-    programs[] = glCreateProgram();
-        shader = glCreateShader(GL_VERTEX_SHADER);
-        load_shader(shader, "");
-        glCompileShader(shader);
-        glAttachShader(programs[], shader);
-    glLinkProgram(programs[]);
+    GLInt status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        GLInt length = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        std::string log(length > 0 ? length : 1, '\0');
+        glGetProgramInfoLog(program, log.size(), nullptr, &log[0]);
+        std::cerr << "Shader: link failed: " << log.c_str() << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
 
-    */
+    if (!binary.empty()) SaveBinary(program, binary);
+    return program;
+}
+
+bool Shader::LoadBinary(GLUint program, const std::string &filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) return false;
+
+    uint32_t header[2];
+    if (!in.read(reinterpret_cast<Char*>(header), sizeof(header)) || header[0] != BINARY_MAGIC)
+        return false;
+    std::string data((std::istreambuf_iterator<Char>(in)), std::istreambuf_iterator<Char>());
+    if (data.empty()) return false;
+
+    // Drivers may refuse a binary they wrote themselves (e.g. after an
+    // update that kept the version string); that is not an error.
+    glProgramBinary(program, header[1], data.data(), data.size());
+    GLInt status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        std::cerr << "Shader: driver rejected " << filename << ", recompiling" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Shader::SaveBinary(GLUint program, const std::string &filename)
+{
+    GLInt length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    std::string data(length, '\0');
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, &data[0]);
+    if (length <= 0) return;
+
+    // Write aside and rename, so a crash never leaves a torn binary behind.
+    std::string temporary = filename + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        uint32_t header[2] = {BINARY_MAGIC, format};
+        out.write(reinterpret_cast<const Char*>(header), sizeof(header));
+        out.write(data.data(), length);
+        if (!out)
+        {
+            std::cerr << "Shader: can't write " << temporary << std::endl;
+            return;
+        }
+    }
+    if (rename(temporary.c_str(), filename.c_str()) != 0)
+        std::cerr << "Shader: can't replace " << filename << std::endl;
 }
 
 void Shader::Activate(Int pid)
 {
-    glUseProgram(programs[pid]);
+    if (pid < 0 || pid >= static_cast<Int>(programs.size()))
+    {
+        std::cerr << "Shader: no program " << pid << std::endl;
+        return;
+    }
+    glUseProgram(programs[pid].name);
     current_pid = pid;
+    ++calls;
 }
 
 void Shader::Deactivate()
 {
     glUseProgram(0);
-}
\ No newline at end of file
+    ++calls;
+}
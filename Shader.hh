@@ -1,38 +1,123 @@
 #pragma once
 
 #include "Definitions.hh"
+#include "utils/gl_elems.hh"
+#include "utils/hash.hh"
+#include "cstring"
 
-#define POOL 5
+#define SHADER_MANIFEST "shaders/manifest"
+#define SHADER_CACHE    "shaders/cache"
 
 enum
 {
     // GLSL LIST
 };
 
+// Programs live in a registry that only grows, so a handle stays valid for
+// the life of the Shader. The manifest names one program per line,
+// "vertex.glsl fragment.glsl", relative to the manifest; line n (blank lines
+// and # comments skipped) gets handle Handle(n), which is n for the GLSL
+// list as long as no Add came before the line was first loaded. Reloading
+// rebuilds the same handles, and lines new to the manifest are appended
+// after whatever Add has registered meanwhile. Linked programs are kept in the
+// cache directory as driver binaries, keyed by their sources and the GL
+// vendor, renderer and version, and reloaded from there when they match.
+//
+// Active uniforms are reflected once per program after linking, so lookups
+// by name (or by a Name() hash computed at compile time) never reach the
+// driver. DriverCalls() counts the GL calls made since BeginFrame(). Blocks
+// named Frame and Draw are bound to the UniformRing binding points.
 class Shader
 {
 public:
     Shader();
     ~Shader();
 
-    void Load();
+    bool Load(const Char *manifest = SHADER_MANIFEST, const Char *cache = SHADER_CACHE);
+    // Handle of the new program, or -1 if it doesn't build.
+    Int  Add(const Char *vertex, const Char *fragment);
+    Int  Programs() const { return programs.size(); }
+    // Handle of manifest line n, or -1 if the manifest has no such line.
+    Int  Handle(Int line) const { return line >= 0 && line < (Int)manifest_handles.size() ? manifest_handles[line] : -1; }
     void Activate(Int pid);
     void Deactivate();
+    // Programs the last Load took from the binary cache, and its time in ms.
+    Int  Cached() const { return cached; }
+    Float LoadTime() const { return load_time; }
+    void BeginFrame() { calls = 0; }
+    Int  DriverCalls() const { return calls; }
+
+    // FNV-1a of a uniform name; usable in constant expressions.
+    static constexpr uint64_t Name(const Char *s)
+    {
+        return utils::fnv1a_string(s);
+    }
+
+    // The setter is picked at compile time from gl::glm_type_traits<T>, so
+    // T must be one of the types it covers (int, float, glm vectors and
+    // matrices, std::array of those). Each program keeps a copy of what
+    // its uniforms hold; a set that would not change it is dropped.
+    template<typename T>
+    void SetUniform(uint64_t name, const T &value)
+    {
+        const Uniform *u = Find(name);
+        if (!u) return;
+        if (static_cast<Int>(sizeof(T)) <= u->bytes)
+        {
+            uint8_t *shadow = programs[current_pid].shadow.data() + u->offset;
+            if (memcmp(shadow, &value, sizeof(T)) == 0) return;
+            memcpy(shadow, &value, sizeof(T));
+        }
+        gl::glm_type_traits<T>::set_uniform(u->location, value);
+        ++calls;
+    }
 
     template<typename T>
-    void SetUniform(Char* uniform, T value)
+    void SetUniform(const Char* uniform, const T &value)
     {
-        GLInt location = glGetUniformLocation(programs[current_pid], uniform);
-        if (location == -1) return;
-        if (typeid(T) == typeid(Int)) glUniform1i(location, value);
-        else glUniform1f(location, value);
+        SetUniform(Name(uniform), value);
     }
 
-    GLInt GetLocation(Char* uniform)
+    GLInt GetLocation(uint64_t name) const;
+    GLInt GetLocation(const Char* uniform) const
     {
-        return glGetUniformLocation(programs[current_pid], uniform);
+        return GetLocation(Name(uniform));
     }
 private:
-    GLUint programs[POOL];
+    struct Uniform
+    {
+        uint64_t name;
+        GLInt location;
+        GLenum type;
+        GLInt count;
+        Int offset;   // into the program's shadow values
+        Int bytes;    // shadowed from here to the end of the array, 0 if none
+        bool operator<(const Uniform &o) const { return name < o.name; }
+    };
+
+    struct Program
+    {
+        GLUint name;
+        std::vector<Uniform> uniforms; // sorted by name hash
+        std::vector<uint8_t> shadow;
+    };
+
+    std::vector<Program> programs;
+    std::vector<Int> manifest_handles; // one per manifest line
     Int current_pid;
-};
\ No newline at end of file
+    Int cached;
+    Int calls;
+    Float load_time;
+    bool prepared;
+    bool binaries;
+    std::string cache_dir;
+    uint64_t driver_hash;
+
+    void Prepare(const Char *cache);
+    bool Install(Int pid, const std::string &vertex_file, const std::string &fragment_file);
+    void Reflect(Int pid);
+    const Uniform *Find(uint64_t name) const;
+    GLUint Build(const std::string &vertex, const std::string &fragment, const std::string &binary);
+    static bool LoadBinary(GLUint program, const std::string &filename);
+    static void SaveBinary(GLUint program, const std::string &filename);
+};
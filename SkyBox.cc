@@ -1,72 +1,189 @@
 #include "SkyBox.hh"
+#include "cstring"
 
 SkyBox::SkyBox(){}
 SkyBox::~SkyBox(){}
 
-void SkyBox::Load(Float zfar)
+static const Char *sky_vs =
+    "#version 130\n"
+    "in vec3 position;\n"
+    "out vec3 direction;\n"
+    "void main()\n"
+    "{\n"
+    "    direction = position;\n"
+    "    vec4 p = gl_ProjectionMatrix * vec4(mat3(gl_ModelViewMatrix) * position, 1.0);\n"
+    "    gl_Position = p.xyww;\n"
+    "}\n";
+
+static const Char *sky_fs =
+    "#version 130\n"
+    "uniform samplerCube sky;\n"
+    "in vec3 direction;\n"
+    "void main() { gl_FragColor = texture(sky, direction); }\n";
+
+// Where a direction lands in the atlas: the middle band holds +X, +Z, -X
+// and -Z left to right, +Y sits above +Z and -Y below it. u and v run
+// over the whole atlas, v = 0 on its first row.
+static void atlas_coord(const Float d[3], Float &u, Float &v)
+{
+    const Float th = 1.0f / 3.0f;
+    Float ax = fabs(d[0]), ay = fabs(d[1]), az = fabs(d[2]);
+    if(ay >= ax && ay >= az)
+    {
+        Float x = d[0] / ay, z = d[2] / ay;
+        u = 0.25f + 0.25f*(1.0f - x)*0.5f;
+        v = d[1] > 0.0f ? th*(z + 1.0f)*0.5f : 2*th + th*(1.0f - z)*0.5f;
+        return;
+    }
+    Float m = std::max(ax, az), y = d[1] / m;
+    v = th + th*(1.0f - y)*0.5f;
+    if(ax >= az) u = d[0] > 0.0f ? 0.25f*(d[2]/ax + 1.0f)*0.5f : 0.5f + 0.25f*(1.0f - d[2]/ax)*0.5f;
+    else         u = d[2] > 0.0f ? 0.25f + 0.25f*(1.0f - d[0]/az)*0.5f : 0.75f + 0.25f*(d[0]/az + 1.0f)*0.5f;
+}
+
+bool SkyBox::CutAtlas(const Image &atlas, std::vector<Image> &faces)
+{
+    Int w = atlas.width, h = atlas.height, n = w / 4;
+    if(n == 0 || w != n*4 || h != n*3)
+    {
+        std::cerr << "SkyBox: atlas is " << w << "x" << h << ", not a 4x3 cross" << std::endl;
+        return false;
+    }
+
+    // Each cube texel takes the atlas texel its direction used to hit,
+    // with the cube map face axes of the GL spec.
+    faces.assign(6, Image());
+    for(Int f = 0; f < 6; f++)
+    {
+        Image &face = faces[f];
+        face.width = face.height = n;
+        face.pixels.resize((size_t)n*n*4);
+        for(Int j = 0; j < n; j++)
+        {
+            for(Int i = 0; i < n; i++)
+            {
+                Float sc = (i + 0.5f) * 2.0f / n - 1.0f, tc = (j + 0.5f) * 2.0f / n - 1.0f;
+                Float d[6][3] = { { 1.0f, -tc, -sc }, { -1.0f, -tc, sc }, { sc, 1.0f, tc },
+                                  { sc, -1.0f, -tc }, { sc, -tc, 1.0f }, { -sc, -tc, -1.0f } };
+                Float u, v;
+                atlas_coord(d[f], u, v);
+                Int x = std::min((Int)(u * w), w-1), y = std::min((Int)(v * h), h-1);
+                memcpy(&face.pixels[((size_t)j*n + i)*4], &atlas.pixels[((size_t)y*w + x)*4], 4);
+            }
+        }
+    }
+    return true;
+}
+
+bool SkyBox::Load(GLUint atlas)
+{
+    Image image;
+    glBindTexture(GL_TEXTURE_2D, atlas);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &image.width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &image.height);
+    image.pixels.resize((size_t)image.width*image.height*4);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    std::vector<Image> faces;
+    if(!CutAtlas(image, faces)) return false;
+    std::unique_ptr<gl::texture_cube_map> texture(new gl::texture_cube_map);
+    texture->bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for(Int f = 0; f < 6; f++)
+        texture->face_image(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, faces[f].width, faces[f].height,
+                            gl::texture_format::rgba8ub, faces[f].pixels.data());
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    return Setup(std::move(texture));
+}
+
+void SkyBox::Load(TextureLoader &loader, const Char *atlas)
+{
+    loader.RequestCube(atlas, CutAtlas, [this](std::unique_ptr<gl::texture_cube_map> texture)
+    {
+        if(texture) Setup(std::move(texture));
+    });
+}
+
+bool SkyBox::Setup(std::unique_ptr<gl::texture_cube_map> texture)
 {
-    Float dst = zfar * cos(45.0f);
-    Float th  =  1.0f / 3.0f;
-    Float of  = (1.0f / 1024.0f) / 2;
-    SkyBox_id = glGenLists(1);
-
-    glNewList(SkyBox_id, GL_COMPILE);
-
-    glBegin(GL_QUADS);
-        glTexCoord2f(0.25f +of, th   -of);  glVertex3f(  dst,  dst,  dst );
-        glTexCoord2f(0.50f -of, th   -of);  glVertex3f( -dst,  dst,  dst );
-        glTexCoord2f(0.50f -of, 0.0f +of);  glVertex3f( -dst,  dst, -dst );
-        glTexCoord2f(0.25f -of, 0.0f +of);  glVertex3f( -dst,  dst, -dst );
-    glEnd();
-
-    glBegin(GL_QUADS);
-        glTexCoord2f(0.25f +of, 1.0f -of);  glVertex3f(  dst, -dst, -dst );
-        glTexCoord2f(0.50f -of, 1.0f -of);  glVertex3f( -dst, -dst, -dst );
-        glTexCoord2f(0.50f -of, 2*th +of);  glVertex3f( -dst,  dst,  dst );
-        glTexCoord2f(0.25f -of, 2*th +of);  glVertex3f(  dst, -dst,  dst );
-    glEnd();
-
-    glBegin(GL_QUADS);
-        glTexCoord2f(0.25f    , 2*th -of);  glVertex3f(  dst, -dst,  dst );
-        glTexCoord2f(0.50f    , 2*th -of);  glVertex3f( -dst, -dst,  dst );
-        glTexCoord2f(0.50f    , 1*th +of);  glVertex3f( -dst,  dst,  dst );
-        glTexCoord2f(0.25f    , 1*th +of);  glVertex3f(  dst,  dst,  dst );
-    glEnd();
-
-    glBegin(GL_QUADS);
-        glTexCoord2f(0.75f    , 2*th -of);  glVertex3f( -dst, -dst,  dst );
-        glTexCoord2f(1.00f    , 2*th -of);  glVertex3f( -dst, -dst, -dst );
-        glTexCoord2f(1.00f    , 1*th +of);  glVertex3f( -dst,  dst, -dst );
-        glTexCoord2f(0.75f    , 1*th +of);  glVertex3f( -dst,  dst,  dst );
-    glEnd();
-
-    glBegin(GL_QUADS);
-        glTexCoord2f(0.50f    , 2*th -of);  glVertex3f( -dst, -dst,  dst );
-        glTexCoord2f(0.75f    , 2*th -of);  glVertex3f( -dst, -dst, -dst );
-        glTexCoord2f(0.75f    , 1*th +of);  glVertex3f( -dst,  dst, -dst );
-        glTexCoord2f(0.50f    , 1*th +of);  glVertex3f( -dst,  dst,  dst );
-    glEnd();
-
-    glBegin(GL_QUADS);
-        glTexCoord2f(0.00f    , 2*th -of);  glVertex3f(  dst, -dst, -dst );
-        glTexCoord2f(0.25f    , 2*th -of);  glVertex3f(  dst, -dst,  dst );
-        glTexCoord2f(0.25f    , 1*th +of);  glVertex3f(  dst,  dst,  dst );
-        glTexCoord2f(0.00f    , 1*th +of);  glVertex3f(  dst,  dst, -dst );
-    glEnd();
-
-    glEndList();
-};
-
-
-void SkyBox::Display(Int tid, Float player_x, Float player_y, Float player_z)
+    cube = std::move(texture);
+    cube->bind();
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    if(program) return true;
+
+    gl::vertex_shader vs;
+    gl::fragment_shader fs;
+    vs.src(sky_vs);
+    vs.compile();
+    fs.src(sky_fs);
+    fs.compile();
+    program.reset(new gl::program);
+    program->attach(vs);
+    program->attach(fs);
+    program->bind_attrib_location("position", 0);
+    program->link();
+    auto status = program->link_status();
+    if(!status.first)
+    {
+        std::cerr << "SkyBox: shader: " << vs.status().second << fs.status().second << status.second << std::endl;
+        program.reset();
+        return false;
+    }
+    program->detach(vs);
+    program->detach(fs);
+    program->use();
+    program->uniform_value(program->uniform_location("sky"), 0);
+    glUseProgram(0);
+
+    // A unit cube seen from inside, two triangles a face.
+    static const GLbyte corners[8][3] = { { -1, -1, -1 }, { 1, -1, -1 }, { -1, 1, -1 }, { 1, 1, -1 },
+                                          { -1, -1,  1 }, { 1, -1,  1 }, { -1, 1,  1 }, { 1, 1,  1 } };
+    static const Int faces[6][4] = { { 1, 5, 3, 7 }, { 4, 0, 6, 2 }, { 2, 3, 6, 7 },
+                                     { 4, 5, 0, 1 }, { 5, 4, 7, 6 }, { 0, 1, 2, 3 } };
+    std::vector<GLbyte> vertices;
+    for(auto &q : faces)
+        for(Int k : { q[0], q[1], q[2], q[2], q[1], q[3] })
+            vertices.insert(vertices.end(), corners[k], corners[k] + 3);
+    box_vertices.reset(new gl::vertex_buffer);
+    box_vertices->data(vertices.size(), vertices.data(), GL_STATIC_DRAW);
+    box.reset(new gl::vertex_array);
+    box->bind();
+    glEnableVertexAttribArray(0);
+    program->bind_attrib_to_buffer(*box_vertices, 0, 3, GL_BYTE, false, 3);
+    box->unbind();
+    return true;
+}
+
+void SkyBox::Display()
 {
-    glPushMatrix();
-    glTranslatef(player_x, player_y, player_z);
+    if(!program) return;
+
+    // z = w puts every fragment at depth 1, so LEQUAL lets it through only
+    // where the depth buffer is still clear.
+    GLint depth_func;
+    glGetIntegerv(GL_DEPTH_FUNC, &depth_func);
+    GLboolean cull = glIsEnabled(GL_CULL_FACE);
+    glDepthFunc(GL_LEQUAL);
+    glDepthMask(GL_FALSE);
+    glDisable(GL_CULL_FACE);
 
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, tid);
-    glCallList(SkyBox_id);
-    glDisable(GL_TEXTURE_2D);
+    program->use();
+    glActiveTexture(GL_TEXTURE0);
+    cube->bind();
+    box->bind();
+    program->draw_elements(GL_TRIANGLES, 36);
+    box->unbind();
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glUseProgram(0);
 
-    glPopMatrix();
-}
\ No newline at end of file
+    if(cull) glEnable(GL_CULL_FACE);
+    glDepthMask(GL_TRUE);
+    glDepthFunc(depth_func);
+}
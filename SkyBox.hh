@@ -1,17 +1,31 @@
 #pragma once
 
 #include "Definitions.hh"
+#include "TextureLoader.hh"
+#include "utils/gl_elems.hh"
+#include "memory"
 
 class SkyBox
 {
 public:
 	SkyBox();
 	~SkyBox();
-	void Load(Float zfar);
-	void Display(Int tid, Float player_x, Float player_y, Float player_z);
+	// Cuts the 4x3 cross atlas texture into the faces of a cube map; the
+	// atlas is not needed afterwards.
+	bool Load(GLUint atlas);
+	// Same from an atlas file, decoded and cut on the loader's workers;
+	// Display draws nothing until the loader has delivered the cube map.
+	void Load(TextureLoader &loader, const Char *atlas);
+	static bool CutAtlas(const Image &atlas, std::vector<Image> &faces);
+	// Draws after the opaque geometry: the box sits on the far plane and
+	// only fills the pixels nothing else has covered.
+	void Display();
 
 private:
-	Int SkyBox_id;
-};
-
+	bool Setup(std::unique_ptr<gl::texture_cube_map> texture);
 
+	std::unique_ptr<gl::texture_cube_map> cube;
+	std::unique_ptr<gl::program> program;
+	std::unique_ptr<gl::vertex_array> box;
+	std::unique_ptr<gl::vertex_buffer> box_vertices;
+};
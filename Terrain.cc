@@ -1,9 +1,17 @@
 #include "Terrain.hh"
+#include "Collision.hh"
+#include "chrono"
+#include "cstring"
+#include "cstddef"
+#include "algorithm"
 
-Terrain::Terrain() { }
+Terrain::Terrain() : heightmap(nullptr), size(0), tile_shift(0), tiles_x(0), normals(nullptr), pyramid_leaf(PYRAMID_LEAF), visible_count(0), chunks_x(0), lod_error(LOD_PIXELS), submitted(0), load_time(0), shown_normals(0), normals_origin(-1), mesh_origin(-1), displaced(false), displace_size(-1)
+{
+    for(Int l = 0; l < LOD_LEVELS; l++) lod_acmr[0][l] = lod_atvr[0][l] = lod_acmr[1][l] = lod_atvr[1][l] = 0.0f;
+}
 Terrain::~Terrain() { }
 
-Vec cross_product(Vec a, Vec b)
+static Vec cross_product(Vec a, Vec b)
 {
     Vec c;
     c.x = a.y * b.z - a.z * b.y;
@@ -14,9 +22,23 @@ Vec cross_product(Vec a, Vec b)
 
 inline bool fcmp(Vec a, Vec b) { return std::abs(a.y) > std::abs(b.y); }
 
-void Terrain::ComputeTriangle(std::vector<Coord> &triangle)
+void Terrain::ComputeTriangle(Int i, Int j, Tri &tri)
 {
-    Tri tri;
+    Int x = i/2;
+    Coord triangle[3];
+    if(i%2 == 0)
+    {
+        triangle[0].x = x;   triangle[0].y = GetVertexHeight(x,   j  );  triangle[0].z = j;
+        triangle[1].x = x;   triangle[1].y = GetVertexHeight(x,   j+1);  triangle[1].z = j+1;
+        triangle[2].x = x+1; triangle[2].y = GetVertexHeight(x+1, j  );  triangle[2].z = j;
+    }
+    else
+    {
+        triangle[0].x = x;   triangle[0].y = GetVertexHeight(x,   j+1);  triangle[0].z = j+1;
+        triangle[1].x = x+1; triangle[1].y = GetVertexHeight(x+1, j  );  triangle[1].z = j;
+        triangle[2].x = x+1; triangle[2].y = GetVertexHeight(x+1, j+1);  triangle[2].z = j+1;
+    }
+
     tri.vertices[0] = triangle[0];
     tri.vertices[1] = triangle[1];
     tri.vertices[2] = triangle[2];
@@ -26,7 +48,7 @@ void Terrain::ComputeTriangle(std::vector<Coord> &triangle)
     tri.center.z = (triangle[0].z + triangle[1].z + triangle[2].z)/3;
 
     Vec a,b;
-    if(triangles.size()%2 != 0) std::swap(triangle[2],triangle[0]);
+    if(i%2 != 0) std::swap(triangle[2],triangle[0]);
     a.x = triangle[1].x - triangle[0].x;
     a.y = triangle[1].y - triangle[0].y;
     a.z = triangle[1].z - triangle[0].z;
@@ -34,7 +56,6 @@ void Terrain::ComputeTriangle(std::vector<Coord> &triangle)
     b.x = triangle[2].x - triangle[1].x;
     b.y = triangle[2].y - triangle[1].y;
     b.z = triangle[2].z - triangle[1].z;
-    if(triangles.size()%2 != 0) std::swap(triangle[2],triangle[0]);
 
     Vec aux = cross_product(a,b);
     Float factor = sqrt( 1.0f/(aux.x*aux.x + aux.y*aux.y + aux.z*aux.z) );
@@ -42,30 +63,1085 @@ void Terrain::ComputeTriangle(std::vector<Coord> &triangle)
     aux.y *= factor;
     aux.z *= factor;
     tri.N = aux;
+}
+
+bool Terrain::Open(const Char *filename)
+{
+    if(!tiles.Open(filename)) return false;
+    heightmap  = tiles.Data();
+    size       = tiles.Size();
+    tile_shift = tiles.TileShift();
+    tiles_x    = tiles.TilesX();
+    normal_data.clear();
+    pyramid_data.clear();
+
+    if(tiles.Baked())
+    {
+        const TileHeader &header = tiles.Header();
+        if(LayoutPyramid(header.pyramid_leaf) != (Int)header.pyramid_count)
+        {
+            std::cerr << filename << ": baked pyramid does not fit a " << size << " map" << std::endl;
+            tiles.Close();
+            heightmap = nullptr;
+            size = tile_shift = tiles_x = 0;
+            return false;
+        }
+        const MinMax *level = (const MinMax*)tiles.Section(header.pyramid);
+        for(Int L = 0; L < (Int)pyramid_width.size(); L++)
+        {
+            pyramid.push_back(level);
+            level += pyramid_width[L]*pyramid_width[L];
+        }
+        normals = (const Normal*)tiles.Section(header.normals);
+        return true;
+    }
+
+    BuildPyramid();
+    normals = nullptr;
+    if(!tiles.Paged())
+    {
+        normal_data.resize((size_t)size*size);
+        SetPerVertexNormal(0, 0, size, size, normal_data.data());
+        normals = normal_data.data();
+    }
+    return true;
+}
+
+void Terrain::Load(const Char *filename)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    chunks.clear();
+    height_texture.reset();
+    displaced = false;
+    if(!Open(filename)) return;
+    chunks_x = size >> CHUNK_SHIFT;
+    chunks.resize(chunks_x*chunks_x);
+    chunk_error.assign(chunks.size()*LOD_LEVELS, 0.0f);
+    visible.resize(chunks.size());
+    visible_count = 0;
+    show_normals.assign(chunks.size(), false);
+    shown_normals = 0;
+
+    // Chunk boxes span the chunk's cells in xz and its pyramid range in y.
+    Int count = chunks_x*chunks_x, side = 1 << CHUNK_SHIFT;
+    for(auto *v : { &chunk_bounds.x0, &chunk_bounds.y0, &chunk_bounds.z0,
+                    &chunk_bounds.x1, &chunk_bounds.y1, &chunk_bounds.z1 })
+        v->assign(count, 0.0f);
+    for(Int c = 0; c < count; c++)
+    {
+        chunk_bounds.x0[c] = (c % chunks_x) * side;  chunk_bounds.x1[c] = std::min((c % chunks_x + 1) * side, size-1);
+        chunk_bounds.z0[c] = (c / chunks_x) * side;  chunk_bounds.z1[c] = std::min((c / chunks_x + 1) * side, size-1);
+        ChunkHeightBounds(c);
+    }
+
+    if(!lod_indices[0]) BuildLodIndices();
+    if(!mesh_program) BuildMeshProgram();
+
+    // Maps that fit in the tile cache are made resident right away.
+    if(!tiles.Paged())
+        for(Int c = 0; c < count; c++) BuildChunk(c);
+    else if(tiles_x*tiles_x <= TILE_CACHE) Focus(size/2, size/2, size);
+
+    std::chrono::duration<Float, std::milli> ms = std::chrono::steady_clock::now() - start;
+    load_time = ms.count();
+}
+
+bool Terrain::LoadHeights(const Char *filename)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    chunks.clear();
+    chunks_x = 0;
+    visible_count = 0;
+    shown_normals = 0;
+    height_texture.reset();
+    displaced = false;
+    if(!Open(filename)) return false;
+
+    std::chrono::duration<Float, std::milli> ms = std::chrono::steady_clock::now() - start;
+    load_time = ms.count();
+    return true;
+}
+
+bool Terrain::Bake(const Char *source, const Char *filename)
+{
+    Terrain baker;
+    return baker.Open(source) && baker.WriteBaked(filename);
+}
+
+bool Terrain::WriteBaked(const Char *filename)
+{
+    const size_t tile_bytes = (size_t)1 << (2*tile_shift);
+    const Int count = tiles_x*tiles_x;
+    const Int pyramid_count = pyramid_width.size() == 0 ? 0 :
+        (Int)(pyramid.back() - pyramid[0]) + pyramid_width.back()*pyramid_width.back();
+
+    TileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TILE_MAGIC, 4);
+    header.version       = TILE_BAKED;
+    header.size          = size;
+    header.tile_shift    = tile_shift;
+    header.normals       = TILE_HEADER + count*tile_bytes;
+    header.checksums     = header.normals + count*tile_bytes*4;
+    header.pyramid       = header.checksums + count*8;
+    header.pyramid_leaf  = pyramid_leaf;
+    header.pyramid_count = pyramid_count;
+
+    std::ofstream ofs(filename, std::ios::binary);
+    if(!ofs) return false;
+    std::vector<Char> page(TILE_HEADER, 0);
+    ofs.write(page.data(), TILE_HEADER);
+    ofs.write((const Char*)heightmap, count*tile_bytes);
+
+    std::vector<uint64_t> sums(count);
+    std::vector<Normal> tile_normals(tile_bytes);
+    const Int side = 1 << tile_shift;
+    for(Int t = 0; t < count; t++)
+    {
+        Int x0 = (t % tiles_x) * side, z0 = (t / tiles_x) * side;
+        HeightGrid grid = { heightmap, size, tile_shift, tiles_x };
+        workers.parallel_for(0, side, BUILD_GRAIN, [&](Int lo, Int hi)
+        {
+            for(Int z = lo; z < hi; z++) GridNormals(grid, x0, z0 + z, side, &tile_normals[z*side]);
+        });
+        ofs.write((const Char*)tile_normals.data(), tile_bytes*4);
+
+        sums[t] = TileCache::Checksum(heightmap + t*tile_bytes, tile_bytes);
+        sums[t] = TileCache::Checksum(tile_normals.data(), tile_bytes*4, sums[t]);
+        if(tiles.Paged()) tiles.Drop(t);
+    }
+    ofs.write((const Char*)sums.data(), count*8);
+    ofs.write((const Char*)pyramid[0], pyramid_count*2);
+
+    uint64_t sum = TileCache::Checksum(&header, sizeof(header));
+    sum = TileCache::Checksum(sums.data(), count*8, sum);
+    header.header_checksum = TileCache::Checksum(pyramid[0], pyramid_count*2, sum);
+    memcpy(page.data(), &header, sizeof(header));
+    ofs.seekp(0);
+    ofs.write(page.data(), TILE_HEADER);
+    return (bool)ofs;
+}
+
+bool Terrain::Focus(Float x, Float z, Float radius)
+{
+    std::vector<Int> loaded, evicted;
+    bool intact = tiles.Focus(x, z, radius, loaded, evicted);
+    // Tiles are whole numbers of chunks: tile_shift >= 6 == CHUNK_SHIFT.
+    Int per = 1 << (tile_shift - CHUNK_SHIFT);
+    if(displaced || chunks.empty()) return intact;
+    for(Int t : evicted)
+        for(Int c : TileChunks(t, per)) chunks[c].reset();
+    for(Int t : loaded)
+        for(Int c : TileChunks(t, per)) BuildChunk(c);
+    return intact;
+}
+
+std::vector<Int> Terrain::TileChunks(Int tile, Int per)
+{
+    std::vector<Int> chunks;
+    Int cx0 = (tile % tiles_x) * per, cz0 = (tile / tiles_x) * per;
+    for(Int cz = cz0; cz < cz0 + per; cz++)
+        for(Int cx = cx0; cx < cx0 + per; cx++)
+            chunks.push_back(cz*chunks_x + cx);
+    return chunks;
+}
+
+void Terrain::SetPerVertexNormal(Int x0, Int z0, Int x1, Int z1, Normal *out)
+{
+    // Rows in parallel, each split at tile edges where the layout of out
+    // stops being contiguous.
+    HeightGrid grid = { heightmap, size, tile_shift, tiles_x };
+    workers.parallel_for(z0, z1, BUILD_GRAIN, [&](Int lo, Int hi)
+    {
+        for(Int z = lo; z < hi; z++)
+        {
+            for(Int x = x0; x < x1; )
+            {
+                Int run = std::min(x1, ((x >> tile_shift) + 1) << tile_shift) - x;
+                GridNormals(grid, x, z, run, out + Index(x, z));
+                x += run;
+            }
+        }
+    });
+}
+
+Normal Terrain::VertexNormal(Int x, Int z)
+{
+    if(normals) return normals[Index(x, z)];
+    HeightGrid grid = { heightmap, size, tile_shift, tiles_x };
+    Normal n;
+    GridNormals(grid, x, z, 1, &n);
+    return n;
+}
+
+Vertex Terrain::PackVertex(Int x, Int height, Int z, const Normal &n)
+{
+    // Octahedral normal: project onto |x|+|y|+|z| = 1 with y up and fold
+    // the lower half over the diagonals.
+    Float ax = n.x, ay = n.y, az = n.z;
+    Float l = fabs(ax) + fabs(ay) + fabs(az);
+    Float u = ax / l, w = az / l;
+    if(ay < 0.0f)
+    {
+        Float fu = (1.0f - fabs(w)) * (u < 0.0f ? -1.0f : 1.0f);
+        Float fw = (1.0f - fabs(u)) * (w < 0.0f ? -1.0f : 1.0f);
+        u = fu; w = fw;
+    }
+    Vertex v = { (GLshort)x, (GLshort)height, (GLshort)z, (GLbyte)lround(u*127.0f), (GLbyte)lround(w*127.0f) };
+    return v;
+}
+
+void Terrain::BuildChunk(Int chunk)
+{
+    std::unique_ptr<Chunk> c(new Chunk);
+    std::vector<Vertex> vertices(CHUNK_VERTS);
+    FillVertices(chunk, 0, CHUNK_GRID-1, vertices.data());
+    FillSkirt(chunk, vertices.data() + CHUNK_GRID*CHUNK_GRID);
+    ChunkErrors(chunk, &chunk_error[chunk*LOD_LEVELS]);
+    c->vertices.data(vertices.size()*sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+    chunks[chunk] = std::move(c);
+}
+
+void Terrain::FillVertices(Int chunk, Int j0, Int j1, Vertex *out)
+{
+    // Local vertex (i, j) of a chunk is clamped to the map, so the chunks
+    // on the far edge repeat their last column or row as zero-area cells.
+    Int x0 = (chunk % chunks_x) << CHUNK_SHIFT, z0 = (chunk / chunks_x) << CHUNK_SHIFT;
+    HeightGrid grid = { heightmap, size, tile_shift, tiles_x };
+    workers.parallel_for(j0, j1 + 1, BUILD_GRAIN, [&](Int lo, Int hi)
+    {
+        for(Int j = lo; j < hi; j++)
+        {
+            Int z = std::min(z0 + j, size-1);
+            Int n = std::min(CHUNK_GRID, size - x0);
+            Normal row[CHUNK_GRID];
+            if(normals) for(Int i = 0; i < n; i++) row[i] = normals[Index(x0 + i, z)];
+            else GridNormals(grid, x0, z, n, row);
+            for(Int i = 0; i < CHUNK_GRID; i++)
+            {
+                Int x = std::min(x0 + i, size-1);
+                out[(size_t)(j - j0)*CHUNK_GRID + i] = PackVertex(x - x0, Height(x, z), z - z0, row[std::min(i, n-1)]);
+            }
+        }
+    });
+}
+
+void Terrain::FillSkirt(Int chunk, Vertex *out)
+{
+    // The four edges of the grid, dropped to the chunk's lowest height:
+    // z0 row, z1 row, x0 column, x1 column.
+    Int x0 = (chunk % chunks_x) << CHUNK_SHIFT, z0 = (chunk / chunks_x) << CHUNK_SHIFT;
+    Int x1 = std::min(x0 + CHUNK_GRID-1, size-1), z1 = std::min(z0 + CHUNK_GRID-1, size-1);
+    Int floor = lround(chunk_bounds.y0[chunk] * FACTOR);
+    for(Int k = 0; k < CHUNK_GRID; k++)
+    {
+        Int x = std::min(x0 + k, size-1), z = std::min(z0 + k, size-1);
+        Int edge[4][2] = { { x, z0 }, { x, z1 }, { x0, z }, { x1, z } };
+        for(Int e = 0; e < 4; e++)
+            out[e*CHUNK_GRID + k] = PackVertex(edge[e][0] - x0, floor, edge[e][1] - z0,
+                                               VertexNormal(edge[e][0], edge[e][1]));
+    }
+}
+
+void Terrain::ChunkErrors(Int chunk, Float *error)
+{
+    // error[l] is the largest height difference between the full grid and
+    // the level l grid of every 2^l-th vertex, split like ComputeTriangle.
+    Int x0 = (chunk % chunks_x) << CHUNK_SHIFT, z0 = (chunk / chunks_x) << CHUNK_SHIFT;
+    GLUbyte h[CHUNK_GRID][CHUNK_GRID];
+    for(Int j = 0; j < CHUNK_GRID; j++)
+        for(Int i = 0; i < CHUNK_GRID; i++)
+            h[j][i] = Height(std::min(x0 + i, size-1), std::min(z0 + j, size-1));
+
+    error[0] = 0.0f;
+    for(Int l = 1; l < LOD_LEVELS; l++)
+    {
+        Int s = 1 << l;
+        Float worst = 0.0f;
+        for(Int j = 0; j < CHUNK_GRID; j++)
+        {
+            for(Int i = 0; i < CHUNK_GRID; i++)
+            {
+                Int ci = std::min(i / s, (CHUNK_GRID-1) / s - 1) * s;
+                Int cj = std::min(j / s, (CHUNK_GRID-1) / s - 1) * s;
+                Float u = (Float)(i - ci) / s, v = (Float)(j - cj) / s;
+                Float h00 = h[cj][ci], h10 = h[cj][ci+s], h01 = h[cj+s][ci], h11 = h[cj+s][ci+s];
+                Float coarse = u + v <= 1.0f ? h00 + u*(h10 - h00) + v*(h01 - h00)
+                                             : h11 + (1.0f - u)*(h01 - h11) + (1.0f - v)*(h10 - h11);
+                worst = std::max(worst, std::abs(coarse - h[j][i]));
+            }
+        }
+        error[l] = std::max(worst / FACTOR, error[l-1]);
+    }
+}
+
+void Terrain::BuildLodIndices()
+{
+    // Level l draws every 2^l-th vertex of the shared chunk grid plus a
+    // skirt strip on each edge that hides cracks against finer neighbours.
+    for(Int l = 0; l < LOD_LEVELS; l++)
+    {
+        Int s = 1 << l, n = (CHUNK_GRID-1) / s;
+        std::vector<GLushort> indices;
+        indices.reserve(n*n*6 + 4*n*6);
+        for(Int j = 0; j < n; j++)
+        {
+            for(Int i = 0; i < n; i++)
+            {
+                GLushort v00 = j*s*CHUNK_GRID + i*s, v10 = v00 + s;
+                GLushort v01 = v00 + s*CHUNK_GRID, v11 = v01 + s;
+                indices.insert(indices.end(), { v00, v01, v10, v01, v10, v11 });
+            }
+        }
+        for(Int k = 0; k < n; k++)
+        {
+            Int a = k*s, b = a + s;
+            GLushort top[4][2] = { { (GLushort)a, (GLushort)b },
+                                   { (GLushort)((CHUNK_GRID-1)*CHUNK_GRID + a), (GLushort)((CHUNK_GRID-1)*CHUNK_GRID + b) },
+                                   { (GLushort)(a*CHUNK_GRID), (GLushort)(b*CHUNK_GRID) },
+                                   { (GLushort)(a*CHUNK_GRID + CHUNK_GRID-1), (GLushort)(b*CHUNK_GRID + CHUNK_GRID-1) } };
+            for(Int e = 0; e < 4; e++)
+            {
+                GLushort A = CHUNK_GRID*CHUNK_GRID + e*CHUNK_GRID + a, B = A + s;
+                indices.insert(indices.end(), { top[e][0], A, top[e][1], top[e][1], A, B });
+            }
+        }
+        // Same triangles, reordered for the post-transform vertex cache.
+        CacheStats(indices, lod_acmr[0][l], lod_atvr[0][l]);
+        indices = OrderForCache(indices, CHUNK_VERTS);
+        CacheStats(indices, lod_acmr[1][l], lod_atvr[1][l]);
+
+        lod_count[l] = indices.size();
+        lod_indices[l].reset(new gl::index_buffer);
+        lod_indices[l]->data(indices.size()*sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+    }
+}
+
+std::vector<GLushort> Terrain::OrderForCache(const std::vector<GLushort> &indices, Int vertex_count)
+{
+    // Tipsify (Sander et al. 2007): fan out from one vertex at a time and
+    // move on to the next live vertex that is still in the cache, falling
+    // back on recently touched vertices and then on input order. Each
+    // triangle keeps its own vertex order, so winding is unchanged.
+    Int count = indices.size() / 3;
+    std::vector<Int> live(vertex_count, 0), offset(vertex_count + 1, 0), adjacency(indices.size());
+    for(GLushort v : indices) live[v]++;
+    for(Int v = 0; v < vertex_count; v++) offset[v+1] = offset[v] + live[v];
+    std::vector<Int> fill(offset.begin(), offset.end() - 1);
+    for(Int t = 0; t < count; t++)
+        for(Int k = 0; k < 3; k++) adjacency[fill[indices[t*3+k]]++] = t;
+
+    std::vector<Int> stamp(vertex_count, 0), dead_end, candidates;
+    std::vector<bool> emitted(count, false);
+    std::vector<GLushort> out;
+    out.reserve(indices.size());
+    Int time = VERTEX_CACHE + 1, cursor = 0, fan = count ? indices[0] : -1;
+    while(fan >= 0)
+    {
+        candidates.clear();
+        for(Int a = offset[fan]; a < offset[fan+1]; a++)
+        {
+            Int t = adjacency[a];
+            if(emitted[t]) continue;
+            emitted[t] = true;
+            for(Int k = 0; k < 3; k++)
+            {
+                GLushort v = indices[t*3+k];
+                out.push_back(v);
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if(time - stamp[v] > VERTEX_CACHE) stamp[v] = time++;
+            }
+        }
+
+        // The candidate furthest into the cache that will still be in it
+        // once its remaining triangles are emitted.
+        Int best = -1, priority = -1;
+        for(Int v : candidates)
+        {
+            if(live[v] <= 0) continue;
+            Int p = 0;
+            if(time - stamp[v] + 2*live[v] <= VERTEX_CACHE) p = time - stamp[v];
+            if(p > priority) { priority = p; best = v; }
+        }
+        while(best < 0 && !dead_end.empty())
+        {
+            Int v = dead_end.back();
+            dead_end.pop_back();
+            if(live[v] > 0) best = v;
+        }
+        while(best < 0 && cursor < vertex_count)
+        {
+            if(live[cursor] > 0) best = cursor;
+            cursor++;
+        }
+        fan = best;
+    }
+    return out;
+}
+
+void Terrain::CacheStats(const std::vector<GLushort> &indices, Float &acmr, Float &atvr)
+{
+    // Vertex shader runs per triangle (ACMR) and per distinct vertex (ATVR)
+    // through a VERTEX_CACHE entry FIFO, the usual hardware model.
+    GLushort fifo[VERTEX_CACHE];
+    Int head = 0, filled = 0, misses = 0;
+    std::vector<bool> seen;
+    Int unique = 0;
+    for(GLushort v : indices)
+    {
+        if(v >= seen.size()) seen.resize(v + 1, false);
+        if(!seen[v]) { seen[v] = true; unique++; }
+        if(std::find(fifo, fifo + filled, v) != fifo + filled) continue;
+        misses++;
+        fifo[head] = v;
+        head = (head + 1) % VERTEX_CACHE;
+        filled = std::min(filled + 1, VERTEX_CACHE);
+    }
+    acmr = indices.empty() ? 0.0f : (Float)misses / (indices.size() / 3);
+    atvr = unique ? (Float)misses / unique : 0.0f;
+}
+
+void Terrain::ChunkHeightBounds(Int chunk)
+{
+    // The deepest pyramid level whose nodes are no larger than a chunk;
+    // on huge maps leaves are coarser than chunks and level 0 is used.
+    Int L = 0;
+    while(L+1 < (Int)pyramid.size() && (pyramid_leaf << (L+1)) <= (1 << CHUNK_SHIFT)) L++;
+    Int node = pyramid_leaf << L, width = pyramid_width[L];
+    Int x0 = (chunk % chunks_x) << CHUNK_SHIFT, z0 = (chunk / chunks_x) << CHUNK_SHIFT;
+    Int x1 = std::min(x0 + (1 << CHUNK_SHIFT), size-1) - 1, z1 = std::min(z0 + (1 << CHUNK_SHIFT), size-1) - 1;
+
+    MinMax mm = { 255, 0 };
+    for(Int nz = z0 / node; nz <= std::min(z1 / node, width-1); nz++)
+    {
+        for(Int nx = x0 / node; nx <= std::min(x1 / node, width-1); nx++)
+        {
+            const MinMax &n = pyramid[L][nz*width + nx];
+            if(n.lo < mm.lo) mm.lo = n.lo;
+            if(n.hi > mm.hi) mm.hi = n.hi;
+        }
+    }
+    chunk_bounds.y0[chunk] = mm.lo / FACTOR;
+    chunk_bounds.y1[chunk] = mm.hi / FACTOR;
+}
+
+Int Terrain::LayoutPyramid(Int leaf)
+{
+    pyramid_leaf = leaf;
+    pyramid.clear();
+    pyramid_width.clear();
+
+    Int width = (size-1 + leaf-1) / leaf, total = 0;
+    for(;;)
+    {
+        pyramid_width.push_back(width);
+        total += width*width;
+        if(width == 1) break;
+        width = (width+1) / 2;
+    }
+    return total;
+}
+
+void Terrain::BuildPyramid()
+{
+    // Large paged maps use coarser leaves so level 0 stays within 1024^2.
+    pyramid_data.resize(LayoutPyramid(std::max(PYRAMID_LEAF, size / MAP_X)));
+    MinMax *level = pyramid_data.data();
+    for(Int L = 0; L < (Int)pyramid_width.size(); L++)
+    {
+        pyramid.push_back(level);
+        level += pyramid_width[L]*pyramid_width[L];
+    }
+
+    // Level 0 is built one tile row at a time, its node rows in parallel,
+    // so the pages of a tile row can be handed back once it is done.
+    Int width = pyramid_width[0];
+    MinMax *leaves = pyramid_data.data();
+    for(Int nz0 = 0, nz1; nz0 < width; nz0 = nz1)
+    {
+        Int tz = (nz0*pyramid_leaf) >> tile_shift;
+        for(nz1 = nz0+1; nz1 < width && ((nz1*pyramid_leaf) >> tile_shift) == tz; nz1++);
+
+        workers.parallel_for(nz0, nz1, 1, [&](Int lo, Int hi)
+        {
+            for(Int nz = lo; nz < hi; nz++)
+                for(Int nx = 0; nx < width; nx++)
+                    leaves[nz*width + nx] = LeafRange(nx, nz);
+        });
+
+        Int tz1 = nz1 == width ? tiles_x : (nz1*pyramid_leaf) >> tile_shift;
+        for(; tz < tz1; tz++)
+            for(Int tx = 0; tx < tiles_x; tx++) tiles.Drop(tz*tiles_x + tx);
+    }
+
+    for(Int L = 1; L < (Int)pyramid_width.size(); L++)
+    {
+        Int lw = pyramid_width[L];
+        workers.parallel_for(0, lw, BUILD_GRAIN, [&](Int lo, Int hi)
+        {
+            for(Int nz = lo; nz < hi; nz++)
+                for(Int nx = 0; nx < lw; nx++)
+                    MergeNode(L, nx, nz);
+        });
+    }
+}
+
+MinMax Terrain::LeafRange(Int nx, Int nz)
+{
+    Int x1 = std::min((nx+1)*pyramid_leaf, size-1);
+    Int z1 = std::min((nz+1)*pyramid_leaf, size-1);
+    MinMax mm = { 255, 0 };
+    for(Int z = nz*pyramid_leaf; z <= z1; z++)
+    {
+        for(Int x = nx*pyramid_leaf; x <= x1; x++)
+        {
+            GLUbyte h = Height(x, z);
+            if(h < mm.lo) mm.lo = h;
+            if(h > mm.hi) mm.hi = h;
+        }
+    }
+    return mm;
+}
+
+void Terrain::MergeNode(Int L, Int nx, Int nz)
+{
+    const MinMax *below = pyramid[L-1];
+    Int bw = pyramid_width[L-1];
+    MinMax mm = { 255, 0 };
+    for(Int z = nz*2; z <= std::min(nz*2+1, bw-1); z++)
+    {
+        for(Int x = nx*2; x <= std::min(nx*2+1, bw-1); x++)
+        {
+            const MinMax &c = below[z*bw + x];
+            if(c.lo < mm.lo) mm.lo = c.lo;
+            if(c.hi > mm.hi) mm.hi = c.hi;
+        }
+    }
+    pyramid_data[(pyramid[L] - pyramid[0]) + nz*pyramid_width[L] + nx] = mm;
+}
 
-    triangles.push_back(tri);
-    std::swap(triangle[1],triangle[0]);
-    std::swap(triangle[2],triangle[1]);
-    triangle.pop_back();
+void Terrain::ModifyHeights(Int x, Int z, Int w, Int h, const GLUbyte *heights)
+{
+    Int x0 = std::max(x, 0), x1 = std::min(x + w, size);
+    Int z0 = std::max(z, 0), z1 = std::min(z + h, size);
+    if(x0 >= x1 || z0 >= z1) return;
+
+    for(Int vz = z0; vz < z1; vz++)
+    {
+        for(Int vx = x0; vx < x1; vx++)
+        {
+            Int t = (vz >> tile_shift)*tiles_x + (vx >> tile_shift);
+            tiles.Edit(t)[Index(vx, vz)] = heights[(size_t)(vz - z)*w + (vx - x)];
+        }
+    }
+
+    // Displaced, the height texture is the only copy the GPU draws from.
+    if(displaced)
+    {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+        height_texture->bind();
+        height_texture->sub_image(x0, z0, x1 - x0, z1 - z0, gl::texture_format::r8,
+                                  heights + (size_t)(z0 - z)*w + (x0 - x));
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+
+    // A baked pyramid is read from the file until the first edit.
+    if(pyramid_data.empty())
+    {
+        const MinMax *top = pyramid.back() + pyramid_width.back()*pyramid_width.back();
+        pyramid_data.assign(pyramid[0], top);
+        for(Int L = (Int)pyramid.size()-1; L >= 0; L--)
+            pyramid[L] = pyramid_data.data() + (pyramid[L] - pyramid[0]);
+    }
+
+    // A leaf block includes its far border vertex, so a vertex can sit in
+    // the node before its own.
+    Int nx0 = std::max(x0-1, 0) / pyramid_leaf, nx1 = std::min((x1-1) / pyramid_leaf, pyramid_width[0]-1);
+    Int nz0 = std::max(z0-1, 0) / pyramid_leaf, nz1 = std::min((z1-1) / pyramid_leaf, pyramid_width[0]-1);
+    for(Int nz = nz0; nz <= nz1; nz++)
+        for(Int nx = nx0; nx <= nx1; nx++)
+            pyramid_data[nz*pyramid_width[0] + nx] = LeafRange(nx, nz);
+    for(Int L = 1; L < (Int)pyramid.size(); L++)
+    {
+        nx0 >>= 1;  nx1 >>= 1;  nz0 >>= 1;  nz1 >>= 1;
+        for(Int nz = nz0; nz <= nz1; nz++)
+            for(Int nx = nx0; nx <= nx1; nx++)
+                MergeNode(L, nx, nz);
+    }
+
+    // Vertex normals change one vertex beyond the edit on every side.
+    Int vx0 = std::max(x0-1, 0), vx1 = std::min(x1+1, size);
+    Int vz0 = std::max(z0-1, 0), vz1 = std::min(z1+1, size);
+    if(normals)
+    {
+        // Baked normals are checked with their tile, so the border tiles
+        // count as edited too.
+        for(Int tz = vz0 >> tile_shift; tz <= (vz1-1) >> tile_shift; tz++)
+            for(Int tx = vx0 >> tile_shift; tx <= (vx1-1) >> tile_shift; tx++)
+                tiles.Edit(tz*tiles_x + tx);
+        Normal *out = normal_data.empty() ? (Normal*)tiles.EditSection(tiles.Header().normals) : normal_data.data();
+        SetPerVertexNormal(vx0, vz0, vx1, vz1, out);
+    }
+
+    // Every chunk holding a changed vertex gets new height bounds and, if
+    // resident, only the vertex rows that changed are uploaded again along
+    // with its skirt and LOD errors.
+    Int cx0 = std::max(vx0-1, 0) >> CHUNK_SHIFT, cx1 = std::min((vx1-1) >> CHUNK_SHIFT, chunks_x-1);
+    Int cz0 = std::max(vz0-1, 0) >> CHUNK_SHIFT, cz1 = std::min((vz1-1) >> CHUNK_SHIFT, chunks_x-1);
+    std::vector<Vertex> rows;
+    for(Int cz = cz0; cz <= cz1; cz++)
+    {
+        for(Int cx = cx0; cx <= cx1; cx++)
+        {
+            Int c = cz*chunks_x + cx;
+            ChunkHeightBounds(c);
+            if(displaced) ChunkErrors(c, &chunk_error[c*LOD_LEVELS]);
+            if(!chunks[c]) continue;
+
+            // The map's last row is repeated in the far chunks' last row.
+            Int z0 = cz << CHUNK_SHIFT;
+            Int j0 = std::max(vz0 - z0, 0);
+            Int j1 = vz1 == size ? CHUNK_GRID-1 : std::min(vz1-1 - z0, CHUNK_GRID-1);
+            rows.resize((size_t)(j1 - j0 + 1)*CHUNK_GRID + 4*CHUNK_GRID);
+            FillVertices(c, j0, j1, rows.data());
+            chunks[c]->vertices.sub_data((size_t)j0*CHUNK_GRID*sizeof(Vertex),
+                                         (j1 - j0 + 1)*CHUNK_GRID*sizeof(Vertex), rows.data());
+            Vertex *skirt = rows.data() + (j1 - j0 + 1)*CHUNK_GRID;
+            FillSkirt(c, skirt);
+            chunks[c]->vertices.sub_data(CHUNK_GRID*CHUNK_GRID*sizeof(Vertex), 4*CHUNK_GRID*sizeof(Vertex), skirt);
+            ChunkErrors(c, &chunk_error[c*LOD_LEVELS]);
+        }
+    }
 }
 
 void Terrain::Display()
 {
-    glCallList(Terrain_id);
+    // Frustum planes of projection * modelview, left unnormalised: only the
+    // sign of a box corner's distance is used.
+    Float proj[16], view[16], m[16], planes[6][4];
+    glGetFloatv(GL_PROJECTION_MATRIX, proj);
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    for(Int c = 0; c < 4; c++)
+        for(Int r = 0; r < 4; r++)
+            m[c*4 + r] = proj[r]*view[c*4] + proj[4 + r]*view[c*4 + 1] + proj[8 + r]*view[c*4 + 2] + proj[12 + r]*view[c*4 + 3];
+    for(Int p = 0; p < 6; p++)
+    {
+        Float sign = p % 2 ? -1.0f : 1.0f;
+        for(Int k = 0; k < 4; k++) planes[p][k] = m[k*4 + 3] + sign*m[k*4 + p/2];
+    }
+
+    Int count = CullBoxes(chunk_bounds, chunks_x*chunks_x, planes, visible.data());
+    visible_count = count;
+
+    // Eye position from the rigid modelview, and the projected size in
+    // pixels of one world unit at distance one.
+    const Float *t = view + 12;
+    Float eye[3] = { -(view[0]*t[0] + view[1]*t[1] + view[2]*t[2]),
+                     -(view[4]*t[0] + view[5]*t[1] + view[6]*t[2]),
+                     -(view[8]*t[0] + view[9]*t[1] + view[10]*t[2]) };
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    Float pixels = proj[5] * viewport[3] * 0.5f;
+
+    submitted = 0;
+    if(displaced)
+    {
+        DisplayDisplaced(count, eye, pixels);
+        return;
+    }
+
+    if(!mesh_program) return;
+    mesh_program->use();
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    for(Int k = 0; k < count; k++)
+    {
+        Int id = visible[k];
+        Chunk *c = chunks[id].get();
+        if(!c) continue;
+
+        Int level = ChunkLevel(id, eye, pixels);
+        glUniform2f(mesh_origin, chunk_bounds.x0[id], chunk_bounds.z0[id]);
+        mesh_program->bind_attrib_to_buffer(c->vertices, 0, 3, GL_SHORT, false, sizeof(Vertex));
+        mesh_program->bind_attrib_to_buffer(c->vertices, 1, 2, GL_BYTE, true, sizeof(Vertex), offsetof(Vertex, u));
+        mesh_program->draw_elements(*lod_indices[level], GL_TRIANGLES, lod_count[level], GL_UNSIGNED_SHORT);
+        submitted += lod_count[level] / 3;
+    }
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(0);
+    glUseProgram(0);
+}
+
+size_t Terrain::MeshBytes() const
+{
+    size_t n = 0;
+    for(auto &c : chunks) if(c) n++;
+    return n * CHUNK_VERTS * sizeof(Vertex);
+}
+
+Int Terrain::ChunkLevel(Int id, const Float *eye, Float pixels)
+{
+    // The coarsest level whose error projects to at most lod_error pixels
+    // from the nearest point of the chunk's box.
+    if(lod_error <= 0.0f) return 0;
+    Float dx = std::max(std::max(chunk_bounds.x0[id] - eye[0], eye[0] - chunk_bounds.x1[id]), 0.0f);
+    Float dy = std::max(std::max(chunk_bounds.y0[id] - eye[1], eye[1] - chunk_bounds.y1[id]), 0.0f);
+    Float dz = std::max(std::max(chunk_bounds.z0[id] - eye[2], eye[2] - chunk_bounds.z1[id]), 0.0f);
+    Float dist = sqrt(dx*dx + dy*dy + dz*dz);
+    const Float *error = &chunk_error[id*LOD_LEVELS];
+    Int level = LOD_LEVELS-1;
+    for(; level > 0; level--)
+        if(error[level]*pixels <= lod_error*dist) break;
+    return level;
+}
+
+// Displacement mode: the whole heightmap is one R8 texture and every chunk
+// is an instance of a single patch of CHUNK_GRID^2 vertices plus skirts,
+// lifted in the vertex shader. Normals come from central differences.
+static const Char *displace_vs =
+    "#version 130\n"
+    "uniform sampler2D heights;\n"
+    "uniform int size;\n"
+    "uniform float scale;\n"
+    "in vec3 patch;\n"
+    "in vec3 origin;\n"
+    "out vec3 normal;\n"
+    "float height(ivec2 p) { return texelFetch(heights, clamp(p, ivec2(0), ivec2(size-1)), 0).r * scale; }\n"
+    "void main()\n"
+    "{\n"
+    "    ivec2 p = min(ivec2(origin.xz) + ivec2(patch.xy), ivec2(size-1));\n"
+    "    float y = patch.z > 0.5 ? origin.y : height(p);\n"
+    "    normal = normalize(vec3(height(p - ivec2(1, 0)) - height(p + ivec2(1, 0)), 2.0,\n"
+    "                            height(p - ivec2(0, 1)) - height(p + ivec2(0, 1))));\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(float(p.x), y, float(p.y), 1.0);\n"
+    "}\n";
+
+// Chunk meshes: chunk-local 16-bit positions with the height in map
+// units, and an octahedral normal decoded here.
+#define CHUNK_VERTEX_GLSL \
+    "#version 130\n" \
+    "uniform vec2 origin;\n" \
+    "uniform float scale;\n" \
+    "in vec3 position;\n" \
+    "in vec2 octahedral;\n" \
+    "vec3 world() { return vec3(origin.x + position.x, position.y * scale, origin.y + position.z); }\n" \
+    "vec3 decode()\n" \
+    "{\n" \
+    "    vec3 n = vec3(octahedral.x, 1.0 - abs(octahedral.x) - abs(octahedral.y), octahedral.y);\n" \
+    "    if(n.y < 0.0) n.xz = (1.0 - abs(n.zx)) * vec2(n.x < 0.0 ? -1.0 : 1.0, n.z < 0.0 ? -1.0 : 1.0);\n" \
+    "    return normalize(n);\n" \
+    "}\n"
+
+static const Char *mesh_vs =
+    CHUNK_VERTEX_GLSL
+    "out vec3 normal;\n"
+    "void main()\n"
+    "{\n"
+    "    normal = decode();\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(world(), 1.0);\n"
+    "}\n";
+
+// Debug normals: each chunk vertex is one instance of a two-index line,
+// and index 1 is moved along the vertex's normal.
+static const Char *normals_vs =
+    CHUNK_VERTEX_GLSL
+    "uniform float length;\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 p = world() + (gl_VertexID == 1 ? decode() * length : vec3(0.0));\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+    "}\n";
+
+static const Char *normals_fs =
+    "#version 130\n"
+    "void main() { gl_FragColor = vec4(1.0, 1.0, 0.0, 1.0); }\n";
+
+static const Char *terrain_fs =
+    "#version 130\n"
+    "in vec3 normal;\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 n = normalize(gl_NormalMatrix * normal);\n"
+    "    float k = max(dot(n, normalize(gl_LightSource[0].position.xyz)), 0.0);\n"
+    "    gl_FragColor = vec4(gl_LightModel.ambient.rgb + gl_LightSource[0].diffuse.rgb * k, 1.0);\n"
+    "}\n";
+
+bool Terrain::SetDisplacement(bool on)
+{
+    if(on == displaced) return true;
+    if(on)
+    {
+        if(!displace_program && !BuildDisplacement()) return false;
+        GLint limit = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &limit);
+        if(size > limit)
+        {
+            std::cerr << "Terrain: " << size << "^2 map exceeds the " << limit << " texture limit" << std::endl;
+            return false;
+        }
+
+        // Every chunk is drawable, so the whole map is uploaded tile by
+        // tile; paged tiles are handed back once they are in the texture.
+        height_texture.reset(new gl::texture_2d);
+        height_texture->bind();
+        height_texture->make_storage(size, size, gl::texture_format::r8);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        Int side = 1 << tile_shift;
+        for(Int t = 0; t < tiles_x*tiles_x; t++)
+        {
+            height_texture->sub_image((t % tiles_x) * side, (t / tiles_x) * side, side, side, gl::texture_format::r8,
+                                      heightmap + ((size_t)t << (2*tile_shift)));
+            tiles.Drop(t);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        for(Int c = 0; c < chunks_x*chunks_x; c++)
+        {
+            chunks[c].reset();
+            ChunkErrors(c, &chunk_error[c*LOD_LEVELS]);
+        }
+        displaced = true;
+    }
+    else
+    {
+        height_texture.reset();
+        displaced = false;
+        Int per = 1 << (tile_shift - CHUNK_SHIFT);
+        for(Int t = 0; t < tiles_x*tiles_x; t++)
+            if(tiles.Resident(t))
+                for(Int c : TileChunks(t, per)) BuildChunk(c);
+    }
+    return true;
+}
+
+std::unique_ptr<gl::program> Terrain::LinkProgram(const Char *vertex, const Char *fragment,
+                                                  const Char *attrib0, const Char *attrib1)
+{
+    gl::vertex_shader vs;
+    gl::fragment_shader fs;
+    vs.src(vertex);
+    vs.compile();
+    fs.src(fragment);
+    fs.compile();
+    std::unique_ptr<gl::program> program(new gl::program);
+    program->attach(vs);
+    program->attach(fs);
+    program->bind_attrib_location(attrib0, 0);
+    program->bind_attrib_location(attrib1, 1);
+    program->link();
+    auto status = program->link_status();
+    if(!status.first)
+    {
+        std::cerr << "Terrain: shader: " << vs.status().second << fs.status().second
+                  << status.second << std::endl;
+        return nullptr;
+    }
+    program->detach(vs);
+    program->detach(fs);
+    return program;
+}
+
+bool Terrain::BuildMeshProgram()
+{
+    mesh_program = LinkProgram(mesh_vs, terrain_fs, "position", "octahedral");
+    if(!mesh_program) return false;
+    mesh_program->use();
+    mesh_program->uniform_value(mesh_program->uniform_location("scale"), 1.0f / FACTOR);
+    mesh_origin = mesh_program->uniform_location("origin");
+    glUseProgram(0);
+    return true;
+}
+
+bool Terrain::BuildNormalsProgram()
+{
+    normals_program = LinkProgram(normals_vs, normals_fs, "position", "octahedral");
+    if(!normals_program) return false;
+    normals_program->use();
+    normals_program->uniform_value(normals_program->uniform_location("scale"), 1.0f / FACTOR);
+    normals_program->uniform_value(normals_program->uniform_location("length"), NORMAL_LENGTH);
+    normals_origin = normals_program->uniform_location("origin");
+    glUseProgram(0);
+
+    GLushort line[2] = { 0, 1 };
+    normal_line.reset(new gl::index_buffer);
+    normal_line->data(sizeof(line), line, GL_STATIC_DRAW);
+    return true;
+}
+
+void Terrain::ShowNormals(Float x, Float z, Float radius, bool on)
+{
+    Int side = 1 << CHUNK_SHIFT;
+    Int cx0 = std::max(0, (Int)(x - radius) / side), cx1 = std::min(chunks_x-1, (Int)(x + radius) / side);
+    Int cz0 = std::max(0, (Int)(z - radius) / side), cz1 = std::min(chunks_x-1, (Int)(z + radius) / side);
+    for(Int cz = cz0; cz <= cz1; cz++)
+    {
+        for(Int cx = cx0; cx <= cx1; cx++)
+        {
+            Int c = cz*chunks_x + cx;
+            if(show_normals[c] == on) continue;
+            show_normals[c] = on;
+            shown_normals += on ? 1 : -1;
+        }
+    }
+}
+
+void Terrain::Normals()
+{
+    // Draws the normals of the marked chunks that passed the last
+    // Display's culling, straight from their vertex buffers.
+    if(!shown_normals || displaced) return;
+    if(!normals_program && !BuildNormalsProgram()) return;
+
+    normals_program->use();
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(0, 1);
+    glVertexAttribDivisor(1, 1);
+    for(Int k = 0; k < visible_count; k++)
+    {
+        Int id = visible[k];
+        Chunk *c = chunks[id].get();
+        if(!c || !show_normals[id]) continue;
+
+        glUniform2f(normals_origin, chunk_bounds.x0[id], chunk_bounds.z0[id]);
+        normals_program->bind_attrib_to_buffer(c->vertices, 0, 3, GL_SHORT, false, sizeof(Vertex));
+        normals_program->bind_attrib_to_buffer(c->vertices, 1, 2, GL_BYTE, true, sizeof(Vertex), offsetof(Vertex, u));
+        normals_program->draw_elements_instanced(*normal_line, CHUNK_GRID*CHUNK_GRID, GL_LINES, 2, GL_UNSIGNED_SHORT);
+    }
+    glVertexAttribDivisor(1, 0);
+    glVertexAttribDivisor(0, 0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(0);
+    glUseProgram(0);
+}
+
+bool Terrain::BuildDisplacement()
+{
+    auto program = LinkProgram(displace_vs, terrain_fs, "patch", "origin");
+    if(!program) return false;
+
+    program->use();
+    program->uniform_value(program->uniform_location("heights"), 0);
+    program->uniform_value(program->uniform_location("scale"), 255.0f / FACTOR);
+    displace_size = program->uniform_location("size");
+    glUseProgram(0);
+    displace_program = std::move(program);
+
+    // The patch mirrors a chunk's vertex buffer: the grid, then the z0
+    // row, z1 row, x0 column and x1 column of the skirt.
+    std::vector<Float> patch;
+    patch.reserve(CHUNK_VERTS*3);
+    for(Int j = 0; j < CHUNK_GRID; j++)
+        for(Int i = 0; i < CHUNK_GRID; i++)
+            patch.insert(patch.end(), { (Float)i, (Float)j, 0.0f });
+    for(Int e = 0; e < 4; e++)
+    {
+        for(Int k = 0; k < CHUNK_GRID; k++)
+        {
+            Float edge[4][2] = { { (Float)k, 0.0f }, { (Float)k, CHUNK_GRID-1.0f },
+                                 { 0.0f, (Float)k }, { CHUNK_GRID-1.0f, (Float)k } };
+            patch.insert(patch.end(), { edge[e][0], edge[e][1], 1.0f });
+        }
+    }
+    patch_vertices.reset(new gl::vertex_buffer);
+    patch_vertices->data(patch.size()*sizeof(Float), patch.data(), GL_STATIC_DRAW);
+    patch_instances.reset(new gl::vertex_buffer);
+    return true;
+}
+
+void Terrain::DisplayDisplaced(Int count, const Float *eye, Float pixels)
+{
+    // One instance per visible chunk, grouped by LOD level so each level
+    // is a single instanced draw.
+    std::vector<Float> instances[LOD_LEVELS];
+    for(Int k = 0; k < count; k++)
+    {
+        Int id = visible[k];
+        auto &level = instances[ChunkLevel(id, eye, pixels)];
+        level.insert(level.end(), { chunk_bounds.x0[id], chunk_bounds.y0[id], chunk_bounds.z0[id] });
+    }
+    std::vector<Float> packed;
+    packed.reserve(count*3);
+    for(auto &level : instances) packed.insert(packed.end(), level.begin(), level.end());
+    patch_instances->data(packed.size()*sizeof(Float), packed.data(), GL_STREAM_DRAW);
+
+    displace_program->use();
+    displace_program->uniform_value(displace_size, (int)size);
+    glActiveTexture(GL_TEXTURE0);
+    height_texture->bind();
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    displace_program->bind_attrib_to_buffer(*patch_vertices, 0, 3, GL_FLOAT, false, 3*sizeof(Float));
+    glVertexAttribDivisor(1, 1);
+
+    size_t first = 0;
+    for(Int l = 0; l < LOD_LEVELS; l++)
+    {
+        Int n = instances[l].size() / 3;
+        if(!n) continue;
+        displace_program->bind_attrib_to_buffer(*patch_instances, 1, 3, GL_FLOAT, false, 3*sizeof(Float), first*3*sizeof(Float));
+        displace_program->draw_elements_instanced(*lod_indices[l], n, GL_TRIANGLES, lod_count[l], GL_UNSIGNED_SHORT);
+        submitted += n * (lod_count[l] / 3);
+        first += n;
+    }
+
+    glVertexAttribDivisor(1, 0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+}
+
+
+Float Terrain::GetHeight(Float x, Float z)
+{
+    HeightGrid grid = { heightmap, size, tile_shift, tiles_x };
+    Float y;
+    GridHeights(grid, &x, &z, &y, 1);
+    return y;
+}
+
+void Terrain::GetHeights(const Float *x, const Float *z, Float *y, Int count)
+{
+    HeightGrid grid = { heightmap, size, tile_shift, tiles_x };
+    workers.parallel_for(0, count, HEIGHT_GRAIN, [&](Int lo, Int hi)
+    {
+        GridHeights(grid, x + lo, z + lo, y + lo, hi - lo);
+    });
 }
 
 Float Terrain::GetVertexHeight(Int x, Int z)
 {
-    return heightmap[(Int)z * MAP_X + (Int)x] / FACTOR;
+    return Height(x, z) / FACTOR;
 }
 
-bool Terrain::CollisionCheck(Coord P, Float radius, Tri tri, Coord &center)
+inline bool inside_xz(const Tri &tri, const Coord &I)
+{
+    Float tri_orientation = (tri.vertices[0].x - tri.vertices[2].x) * (tri.vertices[1].z - tri.vertices[2].z)
+                            - (tri.vertices[0].z - tri.vertices[2].z) * (tri.vertices[1].x - tri.vertices[2].x);
+    Float ABIor = (tri.vertices[0].x - I.x) * (tri.vertices[1].z - I.z) - (tri.vertices[0].z - I.z) * (tri.vertices[1].x - I.x);
+    Float BCIor = (tri.vertices[1].x - I.x) * (tri.vertices[2].z - I.z) - (tri.vertices[1].z - I.z) * (tri.vertices[2].x - I.x);
+    Float CAIor = (tri.vertices[2].x - I.x) * (tri.vertices[0].z - I.z) - (tri.vertices[2].z - I.z) * (tri.vertices[0].x - I.x);
+    if( tri_orientation >= 0.0f && (ABIor < 0.0f  || BCIor < 0.0f || CAIor < 0.0f) )   return false;
+    if( tri_orientation < 0.0f && (ABIor >= 0.0f  || BCIor >= 0.0f || CAIor >= 0.0f) ) return false;
+    return true;
+}
+
+bool Terrain::CollisionCheck(const Coord &P, Float radius, const Tri &tri, Coord &center)
 {
     Coord Q;
     Q.x = P.x + radius*(-tri.N.x);
     Q.y = P.y + radius*(-tri.N.y);
     Q.z = P.z + radius*(-tri.N.z);
-    Vector V;
+    Vec V;
     V.x = Q.x - P.x;
     V.y = Q.y - P.y;
     V.z = Q.z - P.z;
@@ -76,15 +1152,7 @@ bool Terrain::CollisionCheck(Coord P, Float radius, Tri tri, Coord &center)
     if(lambda > 1.0f) return false;
     Coord I;  I.x = P.x + lambda*V.x;  I.y = P.y + lambda*V.y;  I.z = P.z + lambda*V.z;
 
-
-    Float tri_orientation = (tri.vertices[0].x - tri.vertices[2].x) * (tri.vertices[1].z - tri.vertices[2].z)
-                            - (tri.vertices[0].z - tri.vertices[2].z) * (tri.vertices[1].x - tri.vertices[2].x);
-    Float ABIor = (tri.vertices[0].x - I.x) * (tri.vertices[1].z - I.z) - (tri.vertices[0].z - I.z) * (tri.vertices[1].x - I.x);
-    Float BCIor = (tri.vertices[1].x - I.x) * (tri.vertices[2].z - I.z) - (tri.vertices[1].z - I.z) * (tri.vertices[2].x - I.x);
-    Float CAIor = (tri.vertices[2].x - I.x) * (tri.vertices[0].z - I.z) - (tri.vertices[2].z - I.z) * (tri.vertices[0].x - I.x);
-    if( tri_orientation >= 0.0f && (ABIor < 0.0f  || BCIor < 0.0f || CAIor < 0.0f) )   return false;
-    if( tri_orientation < 0.0f && (ABIor >= 0.0f  || BCIor >= 0.0f || CAIor >= 0.0f) ) return false;
-
+    if(!inside_xz(tri, I)) return false;
 
     Float factor = sqrt( (radius*radius)/(tri.N.x*tri.N.x + tri.N.y*tri.N.y + tri.N.z*tri.N.z) );
     center.x = I.x + tri.N.x*factor;
@@ -94,6 +1162,85 @@ bool Terrain::CollisionCheck(Coord P, Float radius, Tri tri, Coord &center)
     return true;
 }
 
+bool Terrain::CollisionCheck(const Coord &P, const Coord &Q, const Tri &tri, Float &lambda)
+{
+    Vec V;
+    V.x = Q.x - P.x;
+    V.y = Q.y - P.y;
+    V.z = Q.z - P.z;
+
+    Float NV = tri.N.x*V.x + tri.N.y*V.y + tri.N.z*V.z;
+    if(NV == 0.0f) return false;
+
+    Float D = -(tri.N.x*tri.vertices[0].x + tri.N.y*tri.vertices[0].y + tri.N.z*tri.vertices[0].z);
+    lambda = -(tri.N.x*P.x + tri.N.y*P.y + tri.N.z*P.z + D) / NV;
+
+    if(lambda < 0.0f || lambda > 1.0f) return false;
+    Coord I;  I.x = P.x + lambda*V.x;  I.y = P.y + lambda*V.y;  I.z = P.z + lambda*V.z;
+
+    return inside_xz(tri, I);
+}
+
+
+static bool nearest_hit(const TriPack &pack, const Coord &P, const Coord &Q, Float &lambda)
+{
+    Float l[PACK_WIDTH];
+    Int mask = PackSegment(pack, P, Q, l);
+    lambda = 1.0f;
+    for(Int k = 0; k < pack.count; k++)
+        if(mask & (1 << k) && l[k] <= lambda) lambda = l[k];
+    return mask != 0;
+}
+
+bool Terrain::WalkSegment(const Coord &P, const Coord &Q, Float t0, Float t1, Float &lambda)
+{
+    Float vx = Q.x - P.x;
+    Float vz = Q.z - P.z;
+
+    Int cx = (Int)floor(P.x + t0*vx);
+    Int cz = (Int)floor(P.z + t0*vz);
+    if(cx < 0) cx = 0; else if(cx > size-2) cx = size-2;
+    if(cz < 0) cz = 0; else if(cz > size-2) cz = size-2;
+
+    Int stepX = vx > 0.0f ? 1 : -1;
+    Int stepZ = vz > 0.0f ? 1 : -1;
+    Float tDeltaX = vx != 0.0f ? std::abs(1.0f/vx) : INFINITY;
+    Float tDeltaZ = vz != 0.0f ? std::abs(1.0f/vz) : INFINITY;
+    Float tMaxX = vx != 0.0f ? ((cx + (stepX > 0 ? 1 : 0)) - P.x)/vx : INFINITY;
+    Float tMaxZ = vz != 0.0f ? ((cz + (stepZ > 0 ? 1 : 0)) - P.z)/vz : INFINITY;
+
+    // Crossed cells are gathered PACK_WIDTH/2 at a time and tested in one
+    // kernel call; the first pack with a hit holds the nearest one.
+    TriPack pack;
+    PackClear(pack);
+    Tri tri;
+    bool last = false;
+    while(!last)
+    {
+        ComputeTriangle(cx*2,   cz, tri);  PackTriangle(pack, tri);
+        ComputeTriangle(cx*2+1, cz, tri);  PackTriangle(pack, tri);
+
+        if(tMaxX < tMaxZ)
+        {
+            cx += stepX;
+            last = tMaxX > t1 || cx < 0 || cx > size-2;
+            tMaxX += tDeltaX;
+        }
+        else
+        {
+            cz += stepZ;
+            last = tMaxZ > t1 || cz < 0 || cz > size-2;
+            tMaxZ += tDeltaZ;
+        }
+
+        if(pack.count == PACK_WIDTH || last)
+        {
+            if(nearest_hit(pack, P, Q, lambda)) return true;
+            PackClear(pack);
+        }
+    }
+    return false;
+}
 
 Float Terrain::GetSegmentIntersection(Float x, Float y, Float z, Float vx, Float vy, Float vz, Float dst)
 {
@@ -102,68 +1249,207 @@ Float Terrain::GetSegmentIntersection(Float x, Float y, Float z, Float vx, Float
     P.y = y;
     P.z = z;
     Coord Q;
-    Q.x = x - dist*vx;
-    Q.y = y - dist*vy;
-    Q.z = z - dist*vz;
+    Q.x = x - dst*vx;
+    Q.y = y - dst*vy;
+    Q.z = z - dst*vz;
 
-    Tri tri;
+    Float lambda, t0 = 0.0f, t1 = 1.0f;
+    if(!ClipToMap(P, Q, t0, t1)) return 1.0f;
+    if(WalkSegment(P, Q, t0, t1, lambda)) return lambda;
+    return 1.0f;
+}
 
-    Float lambda, lowest_lambda = 1.0f;
+void Terrain::GetSegmentIntersections(const Float *x, const Float *y, const Float *z,
+                                      const Float *vx, const Float *vy, const Float *vz,
+                                      const Float *dst, Float *lambda, Int count)
+{
+    // Counting sort of the segments by the block their origin is in (at
+    // least BATCH_BIN cells wide, at most BATCH_BIN^2 blocks), so that
+    // neighbouring work items touch the same heightmap rows.
+    const Int side = std::max(BATCH_BIN, size / BATCH_BIN);
+    const Int bins_x = (size + side-1) / side;
+    std::vector<Int> bin(count), start(bins_x*bins_x + 1, 0), order(count);
+    for(Int n = 0; n < count; n++)
+    {
+        Int bx = (Int)x[n] / side;
+        Int bz = (Int)z[n] / side;
+        if(bx < 0) bx = 0; else if(bx > bins_x-1) bx = bins_x-1;
+        if(bz < 0) bz = 0; else if(bz > bins_x-1) bz = bins_x-1;
+        bin[n] = bz*bins_x + bx;
+        start[bin[n]+1]++;
+    }
+    for(Int b = 0; b < bins_x*bins_x; b++) start[b+1] += start[b];
+    for(Int n = 0; n < count; n++) order[start[bin[n]]++] = n;
 
-    Int trianglePx = ((Int)P.x)*2, trianglePz = (Int)P.z;
-    Int	triangleQx = ((Int)Q.x)*2, triangleQz = (Int)Q.z;
+    workers.parallel_for(0, count, BATCH_GRAIN, [&](Int lo, Int hi)
+    {
+        for(Int k = lo; k < hi; k++)
+        {
+            Int n = order[k];
+            lambda[n] = GetSegmentIntersection(x[n], y[n], z[n], vx[n], vy[n], vz[n], dst[n]);
+        }
+    });
+}
 
+Int Terrain::GetCollisionNormals(const Coord &center, Float radius, Vec *normals, Int capacity)
+{
+    Int x0 = (Int)floor(center.x - radius), x1 = (Int)floor(center.x + radius);
+    Int z0 = (Int)floor(center.z - radius), z1 = (Int)floor(center.z + radius);
+    if(x1 < 0 || z1 < 0 || x0 > size-2 || z0 > size-2) return 0;
+    if(x0 < 0) x0 = 0;
+    if(z0 < 0) z0 = 0;
+    if(x1 > size-2) x1 = size-2;
+    if(z1 > size-2) z1 = size-2;
 
-    if( (trianglePx < 0 && triangleQx < 0) || (trianglePx > (MAP_X-2)*2 && triangleQx > (MAP_X-2)*2) ) return lowest_lambda;
-    if( (trianglePz < 0 && triangleQz < 0) || (trianglePz > (MAP_X-2)   && triangleQz > (MAP_X-2)  ) ) return lowest_lambda;
+    TriPack pack;
+    PackClear(pack);
+    Tri tri;
+    Coord pushed[PACK_WIDTH];
+    Int found = 0;
+    for(Int cz = z0; cz <= z1; cz++)
+    {
+        for(Int cx = x0; cx <= x1; cx++)
+        {
+            ComputeTriangle(cx*2,   cz, tri);  PackTriangle(pack, tri);
+            ComputeTriangle(cx*2+1, cz, tri);  PackTriangle(pack, tri);
+            if(pack.count < PACK_WIDTH && !(cz == z1 && cx == x1)) continue;
 
-    if(trianglePx < 0) trianglePx = 0;
-    else if(trianglePx > (MAP_X-2)*2) trianglePx = (MAP_X-2)*2;
-    if(trianglePz < 0) trianglePz = 0;
-    else if(trianglePz > MAP_X-2) trianglePz = MAP_X-2;
+            Int mask = PackSphere(pack, center, radius, pushed);
+            for(Int k = 0; k < pack.count; k++)
+            {
+                if(!(mask & (1 << k))) continue;
+                if(found < capacity)
+                {
+                    normals[found].x = pack.nx[k];
+                    normals[found].y = pack.ny[k];
+                    normals[found].z = pack.nz[k];
+                }
+                found++;
+            }
+            PackClear(pack);
+        }
+    }
+    return found;
+}
 
-    if(triangleQx < 0) triangleQx = 0;
-    else if(triangleQx > (MAP_X-2)*2) triangleQx = (MAP_X-2)*2;
-    if(triangleQz < 0) triangleQz = 0;
-    else if(triangleQz > MAP_X-2) triangleQz = MAP_X-2;
+std::vector<Vec> Terrain::GetCollisionNormals(Coord &center, Float radius)
+{
+    Vec buffer[BODY_CONTACTS];
+    Int found = GetCollisionNormals(center, radius, buffer, BODY_CONTACTS);
+    if(found <= BODY_CONTACTS) return std::vector<Vec>(buffer, buffer + found);
 
+    std::vector<Vec> normals(found);
+    GetCollisionNormals(center, radius, normals.data(), found);
+    return normals;
+}
 
-    if(trianglePx == triangleQx)
+void Terrain::GetCollisionNormals(const Coord *centers, const Float *radius, Int count,
+                                  Vec *normals, Int capacity, Int *found)
+{
+    workers.parallel_for(0, count, BODY_GRAIN, [&](Int lo, Int hi)
     {
-        if(trianglePz > triangleQz) std::swap(trianglePz,triangleQz);
-        for(Int j = trianglePz; j <= triangleQz; j++)
-        {
-            tri = triangles[j*(MAP_X-1)*2 + trianglePx];
-            if(CollisionCheck(P,Q,tri,lambda) && lambda < lowest_lambda) lowest_lambda = lambda;
-            tri = triangles[j*(MAP_X-1)*2 + trianglePx+1];
-            if(CollisionCheck(P,Q,tri,lambda) && lambda < lowest_lambda) lowest_lambda = lambda;
-        }
-        return lowest_lambda;
-    }
-    if(trianglePz == triangleQz)
+        for(Int n = lo; n < hi; n++)
+            found[n] = GetCollisionNormals(centers[n], radius[n], normals + n*capacity, capacity);
+    });
+}
+
+bool Terrain::ClipToMap(const Coord &P, const Coord &Q, Float &t0, Float &t1)
+{
+    const Float lo[2] = { P.x, P.z };
+    const Float v[2]  = { Q.x - P.x, Q.z - P.z };
+    for(Int k = 0; k < 2; k++)
     {
-        if(trianglePx > triangleQx) std::swap(trianglePx,triangleQx);
-        for(Int i = trianglePx; i <= triangleQx+1; i++)
+        if(v[k] == 0.0f)
         {
-            tri = triangles[trianglePz*(MAP_X-1)*2 + i];
-            if(CollisionCheck(P,Q,tri,lambda) && lambda < lowest_lambda) lowest_lambda = lambda;
+            if(lo[k] < 0.0f || lo[k] > size-1) return false;
+            continue;
         }
-        return lowest_lambda;
+        Float ta = (0.0f    - lo[k]) / v[k];
+        Float tb = (size-1 - lo[k]) / v[k];
+        if(ta > tb) std::swap(ta,tb);
+        if(ta > t0) t0 = ta;
+        if(tb < t1) t1 = tb;
     }
+    return t0 <= t1;
+}
+
+Float Terrain::Raycast(const Coord &origin, const Vec &dir, Float maxDist)
+{
+    Coord P = origin;
+    Coord Q;
+    Q.x = origin.x + maxDist*dir.x;
+    Q.y = origin.y + maxDist*dir.y;
+    Q.z = origin.z + maxDist*dir.z;
+
+    Float t0 = 0.0f, t1 = 1.0f;
+    if(pyramid.empty() || !ClipToMap(P, Q, t0, t1)) return maxDist;
+
+    Float vx = Q.x - P.x;
+    Float vy = Q.y - P.y;
+    Float vz = Q.z - P.z;
+
+    Int cx = (Int)floor(P.x + t0*vx);
+    Int cz = (Int)floor(P.z + t0*vz);
+    if(cx < 0) cx = 0; else if(cx > size-2) cx = size-2;
+    if(cz < 0) cz = 0; else if(cz > size-2) cz = size-2;
+
+    Int top = pyramid.size() - 1;
+    Int L = top;
+    Float t = t0;
+    Float lambda;
 
-    if(trianglePx > triangleQx) std::swap(trianglePx,triangleQx);
-    if(trianglePz > triangleQz) std::swap(trianglePz,triangleQz);
-    for(Int i = trianglePx; i <= triangleQx+1; i++)
+    for(;;)
     {
-        for(Int j = trianglePz; j <= triangleQz; j++)
+        Int node = pyramid_leaf << L;
+        Int nx = cx / node;
+        Int nz = cz / node;
+
+        Float tx = INFINITY, tz = INFINITY;
+        if(vx > 0.0f) tx = ((nx+1)*node - P.x)/vx;
+        if(vx < 0.0f) tx = (nx*node - P.x)/vx;
+        if(vz > 0.0f) tz = ((nz+1)*node - P.z)/vz;
+        if(vz < 0.0f) tz = (nz*node - P.z)/vz;
+        Float texit = std::min(std::min(tx, tz), t1);
+        if(texit < t) texit = t;
+
+        Float ya = P.y + t*vy;
+        Float yb = P.y + texit*vy;
+        const MinMax &mm = pyramid[L][nz*pyramid_width[L] + nx];
+
+        if(std::min(ya,yb) <= mm.hi / FACTOR && std::max(ya,yb) >= mm.lo / FACTOR)
         {
-            tri = triangles[j*(MAP_X-1)*2 + i];
-            if(CollisionCheck(P,Q,tri,lambda) && lambda < lowest_lambda) lowest_lambda = lambda;
+            if(L > 0)
+            {
+                L--;
+                continue;
+            }
+            if(WalkSegment(P, Q, t, texit, lambda)) return lambda * maxDist;
         }
-    }
 
-    return lowest_lambda;
-}
+        if(texit >= t1) break;
 
+        // Step into the neighbouring node through the face the ray leaves
+        // by; the other cell coordinate only ever moves forward so that
+        // rounding at node corners cannot send the walk backwards.
+        if(tx <= tz)
+        {
+            cx = vx > 0.0f ? (nx+1)*node : nx*node - 1;
+            Int c = (Int)floor(P.z + texit*vz);
+            if(vz > 0.0f && c > cz) cz = c;
+            if(vz < 0.0f && c < cz) cz = c;
+        }
+        else
+        {
+            cz = vz > 0.0f ? (nz+1)*node : nz*node - 1;
+            Int c = (Int)floor(P.x + texit*vx);
+            if(vx > 0.0f && c > cx) cx = c;
+            if(vx < 0.0f && c < cx) cx = c;
+        }
+        if(cx < 0 || cx > size-2 || cz < 0 || cz > size-2) break;
 
+        t = texit;
+        if(L < top) L++;
+    }
 
+    return maxDist;
+}
@@ -1,37 +1,215 @@
-#pragma once 
+#pragma once
 
 #include "Definitions.hh"
+#include "TileCache.hh"
+#include "utils/gl_elems.hh"
+#include "utils/thread_pool.hh"
+#include "memory"
 
 struct Coord { Float x,y,z; };
 struct Vec   { Float x,y,z; };
 struct Tri   { Vec N; Coord center; Coord vertices[3]; };
+struct MinMax { GLUbyte lo, hi; };
+struct Normal { GLbyte x,y,z,w; };
+// Chunk vertex: position relative to the chunk origin with y in raw height
+// units, and a 2x8-bit octahedral normal.
+struct Vertex { GLshort x,y,z; GLbyte u,v; };
+
+// Axis-aligned boxes, one lane per box.
+struct BoxSet { std::vector<Float> x0, y0, z0, x1, y1, z1; };
 
 #define MAP_X	 (1024)
 #define MAP_SIZE (1024*1024)
+#define FACTOR   (8.0f)
+
+#define PYRAMID_LEAF (4)
+#define BATCH_BIN    (32)
+#define BATCH_GRAIN  (64)
+#define BODY_GRAIN   (16)
+#define BODY_CONTACTS (32)
+#define BUILD_GRAIN  (8)
+#define HEIGHT_GRAIN (4096)
+#define CHUNK_SHIFT  (6)
+#define CHUNK_GRID   ((1 << CHUNK_SHIFT) + 1)
+#define CHUNK_VERTS  (CHUNK_GRID*CHUNK_GRID + 4*CHUNK_GRID)
+#define LOD_LEVELS   (CHUNK_SHIFT + 1)
+#define LOD_PIXELS   (2.0f)
+#define VERTEX_CACHE (16)
+#define NORMAL_LENGTH (1.0f)
+
+// A chunk's CHUNK_GRID^2 vertices followed by its four skirt edges.
+struct Chunk
+{
+	gl::vertex_buffer vertices;
+};
 
 class Terrain
 {
 public:
 	Terrain();
 	~Terrain();
-	void Load();
+	void Load(const Char *filename);
+	// Loads only what the height and collision queries use: no chunks, no
+	// GL objects, so it works without a context. Display needs Load.
+	bool LoadHeights(const Char *filename);
+	// Writes source as a baked tile file. Works on a Terrain of its own, so
+	// the one it is called through, if any, is left as it was.
+	static bool Bake(const Char *source, const Char *filename);
+	// Pages in the tiles within radius of (x, z) and builds their chunks.
+	// Returns false if one of them failed its checksum: it gets no chunks,
+	// but the height and collision queries still read its heights.
+	bool Focus(Float x, Float z, Float radius);
+	// Replaces the heights of the w*h vertex rectangle at (x, z), row by
+	// row, and updates only what depends on them: the pyramid nodes, the
+	// vertex normals one vertex around the rectangle and the chunks drawing
+	// those cells.
+	void ModifyHeights(Int x, Int z, Int w, Int h, const GLUbyte *heights);
 	void Display();
+	// Screen-space error in pixels a chunk's LOD may show; 0 or less draws
+	// every chunk at full resolution.
+	void SetLodError(Float pixels) { lod_error = pixels; }
+	Int  Submitted() const { return submitted; }
+	// Vertex cache figures of a LOD level, for a FIFO of VERTEX_CACHE
+	// entries: transformed vertices per triangle and per vertex, in row
+	// order and in the cache order that is drawn.
+	void LodCacheStats(Int level, Float &acmr_before, Float &atvr_before, Float &acmr_after, Float &atvr_after) const
+	{
+		acmr_before = lod_acmr[0][level];  atvr_before = lod_atvr[0][level];
+		acmr_after  = lod_acmr[1][level];  atvr_after  = lod_atvr[1][level];
+	}
+	// Vertices per side of the loaded map, 0 if none is.
+	Int  Size() const { return size; }
+	// Milliseconds the last Load or LoadHeights took.
+	Float LoadTime() const { return load_time; }
+	// Bytes of vertex data currently uploaded for chunk meshes.
+	size_t MeshBytes() const;
+	// Draws the terrain as one shared patch instanced per chunk and lifted
+	// from a height texture in the vertex shader, instead of per-chunk
+	// meshes. Fails if shaders or the texture size are not available.
+	bool SetDisplacement(bool on);
+	// Marks the chunks within radius of (x, z) for Normals(), which draws
+	// their vertex normals; nothing is drawn or built while none is marked.
+	void ShowNormals(Float x, Float z, Float radius, bool on);
 	void Normals();
 	Float GetHeight(Float x, Float z);
+	void  GetHeights(const Float *x, const Float *z, Float *y, Int count);
 	Float GetSegmentIntersection(Float x, Float y, Float z, Float vx, Float vy, Float vz, Float dst);
+	Float Raycast(const Coord &origin, const Vec &dir, Float maxDist);
+	void  GetSegmentIntersections(const Float *x, const Float *y, const Float *z,
+	                              const Float *vx, const Float *vy, const Float *vz,
+	                              const Float *dst, Float *lambda, Int count);
 	std::vector<Vec> GetCollisionNormals(Coord &center, Float radius);
+	// Return the number of touching triangles; at most capacity normals are
+	// written, per body for the batched form.
+	Int   GetCollisionNormals(const Coord &center, Float radius, Vec *normals, Int capacity);
+	void  GetCollisionNormals(const Coord *centers, const Float *radius, Int count,
+	                          Vec *normals, Int capacity, Int *found);
 private:
-	GLUbyte heightmap[MAP_SIZE];
+	// Heights are read through the tile cache: a plain MAP_X map is a single
+	// tile, a paged map is mmap'd and addressed tile by tile.
+	TileCache tiles;
+	const GLUbyte *heightmap;
+	Int size;
+	Int tile_shift;
+	Int tiles_x;
+
+	// Per-vertex normals in the heightmap's tile layout. They point into a
+	// baked file, into normal_data for a plain map, or are null for an
+	// unbaked paged map, which computes them per tile as it goes.
+	const Normal *normals;
+	std::vector<Normal> normal_data;
+
+	// pyramid[0] holds the height range of each pyramid_leaf^2 cell block,
+	// every further level merges 2x2 nodes of the one below. The levels
+	// live back to back in pyramid_data or in a baked file.
+	std::vector<MinMax> pyramid_data;
+	std::vector<const MinMax*> pyramid;
+	std::vector<Int> pyramid_width;
+	Int pyramid_leaf;
+
+	utils::thread_pool workers;
+
+	// Resident chunks of 2^CHUNK_SHIFT cells a side, null while their tile
+	// is paged out, and every chunk's bounding box for frustum culling.
+	std::vector< std::unique_ptr<Chunk> > chunks;
+	BoxSet chunk_bounds;
+	std::vector<Int> visible;
+	Int visible_count;
+	Int chunks_x;
+	// Height error of each LOD level against full resolution, LOD_LEVELS
+	// per chunk; kept for every chunk while displaced.
+	std::vector<Float> chunk_error;
+
+	// Index buffers shared by all chunks, one per LOD level.
+	std::unique_ptr<gl::index_buffer> lod_indices[LOD_LEVELS];
+	GLsizei lod_count[LOD_LEVELS];
+	Float lod_acmr[2][LOD_LEVELS], lod_atvr[2][LOD_LEVELS]; // row order, cache order
+	Float lod_error;
+	Int submitted;
+	Float load_time;
+
+	std::vector<bool> show_normals;
+	Int shown_normals;
+	std::unique_ptr<gl::program> normals_program;
+	std::unique_ptr<gl::index_buffer> normal_line;
+	GLint normals_origin;
+
+	std::unique_ptr<gl::program> mesh_program;
+	GLint mesh_origin;
+
+	bool displaced;
+	std::unique_ptr<gl::texture_2d> height_texture;
+	std::unique_ptr<gl::program> displace_program;
+	std::unique_ptr<gl::vertex_buffer> patch_vertices;
+	std::unique_ptr<gl::vertex_buffer> patch_instances;
+	GLint displace_size;
+
+	// Triangles are not stored: triangle i of row j is rebuilt from heightmap[]
+	// with the exact arithmetic the old per-triangle build used.
+	void  ComputeTriangle(Int i, Int j, Tri &tri);
+	// Normals of the vertex rectangle [x0, x1) x [z0, z1) from the heights
+	// around it, written into out in the heightmap's tile layout.
+	void  SetPerVertexNormal(Int x0, Int z0, Int x1, Int z1, Normal *out);
 
-	std::vector<Tri> triangles;
-	Int Terrain_id;
-	Int Normals_id;
+	bool CollisionCheck(const Coord &P, Float radius, const Tri &tri, Coord &center);
+	bool CollisionCheck(const Coord &P, const Coord &Q, const Tri &tri, Float &lambda);
 
-	void  ComputeTriangle(std::vector<Coord> &tri);
-	void  SetPerVertexNormal(Int x, Int y, Int z);
+	// Segment queries walk only the cells the segment crosses in xz
+	// (Amanatides-Woo) and stop at the first cell with a hit.
+	bool ClipToMap(const Coord &P, const Coord &Q, Float &t0, Float &t1);
+	bool WalkSegment(const Coord &P, const Coord &Q, Float t0, Float t1, Float &lambda);
 
-	bool CollisionCheck(Coord P, Float radius, Tri tri, Coord &center);
-	bool CollisionCheck(Coord P, Coord Q, 	   Tri tri, Float &lambda);
+	bool Open(const Char *filename);
+	bool WriteBaked(const Char *filename);
+	Int  LayoutPyramid(Int leaf);
+	void BuildPyramid();
+	MinMax LeafRange(Int nx, Int nz);
+	void MergeNode(Int L, Int nx, Int nz);
+	void BuildChunk(Int chunk);
+	void FillVertices(Int chunk, Int j0, Int j1, Vertex *out);
+	void FillSkirt(Int chunk, Vertex *out);
+	void ChunkErrors(Int chunk, Float *error);
+	void BuildLodIndices();
+	static std::vector<GLushort> OrderForCache(const std::vector<GLushort> &indices, Int vertex_count);
+	static void CacheStats(const std::vector<GLushort> &indices, Float &acmr, Float &atvr);
+	Int  ChunkLevel(Int chunk, const Float *eye, Float pixels);
+	static std::unique_ptr<gl::program> LinkProgram(const Char *vertex, const Char *fragment,
+	                                                const Char *attrib0, const Char *attrib1);
+	bool BuildMeshProgram();
+	bool BuildNormalsProgram();
+	bool BuildDisplacement();
+	void DisplayDisplaced(Int count, const Float *eye, Float pixels);
+	void ChunkHeightBounds(Int chunk);
+	std::vector<Int> TileChunks(Int tile, Int per);
+	Normal VertexNormal(Int x, Int z);
+	static Vertex PackVertex(Int x, Int height, Int z, const Normal &n);
 
+	size_t Index(Int x, Int z)
+	{
+		Int t = (z >> tile_shift)*tiles_x + (x >> tile_shift);
+		Int m = (1 << tile_shift) - 1;
+		return ((size_t)t << (2*tile_shift)) + ((z & m) << tile_shift) + (x & m);
+	}
+	GLUbyte Height(Int x, Int z) { return heightmap[Index(x, z)]; }
 	Float GetVertexHeight(Int x, Int z);
-};
\ No newline at end of file
+};
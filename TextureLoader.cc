@@ -0,0 +1,232 @@
+#include "TextureLoader.hh"
+#include "cstring"
+
+TextureLoader::TextureLoader() : half(0), pending(0), workers(3)
+{
+    staged[0] = staged[1] = 0;
+}
+
+TextureLoader::~TextureLoader()
+{
+    for(auto &job : uploading) glDeleteSync(job->fence);
+    for(GLsync fence : staged) if(fence) glDeleteSync(fence);
+}
+
+void TextureLoader::Request(const Char *filename, Done done)
+{
+    std::shared_ptr<Job> job(new Job);
+    job->filename = filename;
+    job->done = std::move(done);
+    pending++;
+    workers.submit([this, job] { Decode(job); });
+}
+
+void TextureLoader::RequestCube(const Char *filename, CubeCut cut, CubeDone done)
+{
+    std::shared_ptr<Job> job(new Job);
+    job->filename = filename;
+    job->cut = std::move(cut);
+    job->cube_done = std::move(done);
+    pending++;
+    workers.submit([this, job] { Decode(job); });
+}
+
+void TextureLoader::Decode(std::shared_ptr<Job> job)
+{
+    Image image;
+    job->ok = DecodeTGA(job->filename.c_str(), image);
+    if(job->ok && job->cut) job->ok = job->cut(image, job->faces);
+    else if(job->ok) job->faces.push_back(std::move(image));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    decoded.push_back(std::move(job));
+}
+
+static bool Signaled(GLsync fence)
+{
+    // A zero timeout only polls, it never waits on the GPU.
+    GLenum state = glClientWaitSync(fence, 0, 0);
+    return state == GL_ALREADY_SIGNALED || state == GL_CONDITION_SATISFIED;
+}
+
+void TextureLoader::Update()
+{
+    while(!uploading.empty() && Signaled(uploading.front()->fence))
+    {
+        glDeleteSync(uploading.front()->fence);
+        Finish(*uploading.front());
+        uploading.pop_front();
+    }
+
+    if(staged[half])
+    {
+        if(!Signaled(staged[half])) return;
+        glDeleteSync(staged[half]);
+        staged[half] = 0;
+    }
+    if(!staging)
+    {
+        staging.reset(new gl::pixel_unpack_buffer);
+        staging->data(2*LOADER_BUDGET, nullptr, GL_STREAM_DRAW);
+    }
+
+    size_t used = 0;
+    for(;;)
+    {
+        if(!streaming)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(decoded.empty()) break;
+            streaming = std::move(decoded.front());
+            decoded.pop_front();
+        }
+        if(!streaming->ok)
+        {
+            std::cerr << "TextureLoader: cannot load " << streaming->filename << std::endl;
+            Finish(*streaming);
+            streaming.reset();
+            continue;
+        }
+        if(!streaming->texture && !streaming->cube) Begin(*streaming);
+        size_t bytes = Upload(*streaming, half*LOADER_BUDGET + used, LOADER_BUDGET - used);
+        if(!bytes) break;
+        used += bytes;
+        if(streaming->face == streaming->faces.size())
+        {
+            streaming->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            streaming->faces.clear();
+            uploading.push_back(std::move(streaming));
+        }
+    }
+    if(used)
+    {
+        staged[half] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        half ^= 1;
+    }
+}
+
+void TextureLoader::Begin(Job &job)
+{
+    job.face = job.row = 0;
+    if(job.faces.size() == 6)
+    {
+        job.cube.reset(new gl::texture_cube_map);
+        job.cube->bind();
+        for(Int f = 0; f < 6; f++)
+            job.cube->face_image(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, job.faces[f].width, job.faces[f].height,
+                                 gl::texture_format::rgba8ub);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    }
+    else
+    {
+        job.texture.reset(new gl::texture_2d);
+        job.texture->bind();
+        job.texture->make_storage(job.faces[0].width, job.faces[0].height, gl::texture_format::rgba8ub);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+}
+
+size_t TextureLoader::Upload(Job &job, size_t offset, size_t room)
+{
+    // As many rows of the current face as fit in the room left in this
+    // frame's staging half, which the GPU is known to be done with.
+    const Image &image = job.faces[job.face];
+    size_t row_bytes = (size_t)image.width * 4;
+    Int rows = std::min<size_t>(room / row_bytes, image.height - job.row);
+    if(rows <= 0) return 0;
+    size_t bytes = rows * row_bytes;
+
+    void *out = staging->map(offset, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    memcpy(out, &image.pixels[job.row * row_bytes], bytes);
+    staging->unmap();
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if(job.cube)
+    {
+        job.cube->bind();
+        job.cube->face_sub_image(GL_TEXTURE_CUBE_MAP_POSITIVE_X + job.face, 0, job.row, image.width, rows,
+                                 gl::texture_format::rgba8ub, (const GLvoid*)offset);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    }
+    else
+    {
+        job.texture->bind();
+        job.texture->sub_image(0, job.row, image.width, rows, gl::texture_format::rgba8ub, (const GLvoid*)offset);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    staging->unbind();
+
+    job.row += rows;
+    if(job.row == (size_t)image.height)
+    {
+        job.face++;
+        job.row = 0;
+    }
+    return bytes;
+}
+
+void TextureLoader::Finish(Job &job)
+{
+    pending--;
+    if(job.cube_done) job.cube_done(std::move(job.cube));
+    else job.done(std::move(job.texture));
+}
+
+bool TextureLoader::DecodeTGA(const Char *filename, Image &out)
+{
+    // Uncompressed (2) and run-length (10) true-colour files, 24 or 32 bit.
+    std::ifstream ifs(filename, std::ios::binary);
+    GLUbyte header[18];
+    if(!ifs.read((Char*)header, sizeof(header))) return false;
+    Int type = header[2], depth = header[16] / 8;
+    out.width  = header[12] | (header[13] << 8);
+    out.height = header[14] | (header[15] << 8);
+    if((type != 2 && type != 10) || (depth != 3 && depth != 4) || header[1] != 0 || !out.width || !out.height)
+        return false;
+    ifs.seekg(header[0], std::ios::cur);
+
+    size_t count = (size_t)out.width * out.height;
+    std::vector<GLUbyte> raw(count * depth);
+    if(type == 2)
+    {
+        if(!ifs.read((Char*)raw.data(), raw.size())) return false;
+    }
+    else
+    {
+        for(size_t n = 0; n < count; )
+        {
+            Int packet = ifs.get();
+            if(packet < 0) return false;
+            size_t run = std::min((size_t)(packet & 0x7f) + 1, count - n);
+            GLUbyte *p = &raw[n * depth];
+            if(packet & 0x80)
+            {
+                if(!ifs.read((Char*)p, depth)) return false;
+                for(size_t k = 1; k < run; k++) memcpy(p + k*depth, p, depth);
+            }
+            else if(!ifs.read((Char*)p, run * depth)) return false;
+            n += run;
+        }
+    }
+
+    // BGR(A) to RGBA, and bottom-up files flipped to top-down rows.
+    bool top_down = header[17] & 0x20;
+    out.pixels.resize(count * 4);
+    for(Int y = 0; y < out.height; y++)
+    {
+        const GLUbyte *src = &raw[(size_t)(top_down ? y : out.height-1 - y) * out.width * depth];
+        GLUbyte *dst = &out.pixels[(size_t)y * out.width * 4];
+        for(Int x = 0; x < out.width; x++, src += depth, dst += 4)
+        {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+            dst[3] = depth == 4 ? src[3] : 255;
+        }
+    }
+    return true;
+}
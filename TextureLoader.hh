@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Definitions.hh"
+#include "utils/gl_elems.hh"
+#include "utils/thread_pool.hh"
+#include "deque"
+#include "functional"
+#include "memory"
+#include "mutex"
+
+#define LOADER_BUDGET (2 << 20)
+
+// Decoded RGBA8 pixels, rows from the top of the image down.
+struct Image
+{
+	std::vector<GLUbyte> pixels;
+	Int width, height;
+};
+
+// Loads textures off the frame loop: files are read and decoded on worker
+// threads, then streamed in bands of rows through a pixel buffer object of
+// two LOADER_BUDGET halves, one half per frame, and handed over once a fence
+// shows the GPU has consumed the upload. Callbacks run inside Update, on the
+// thread that owns the GL context.
+class TextureLoader
+{
+public:
+	typedef std::function<void(std::unique_ptr<gl::texture_2d>)> Done;
+	typedef std::function<void(std::unique_ptr<gl::texture_cube_map>)> CubeDone;
+	// Turns the decoded file into the six cube faces, on a worker thread.
+	typedef std::function<bool(const Image &source, std::vector<Image> &faces)> CubeCut;
+
+	TextureLoader();
+	~TextureLoader();
+
+	// done gets null if the file cannot be read or decoded.
+	void Request(const Char *filename, Done done);
+	void RequestCube(const Char *filename, CubeCut cut, CubeDone done);
+
+	// Completes the textures the GPU has finished with and uploads up to
+	// LOADER_BUDGET bytes of decoded rows, unless the GPU still reads the
+	// staging half they would go to.
+	void Update();
+	Int  Pending() const { return pending; }
+
+	static bool DecodeTGA(const Char *filename, Image &out);
+
+private:
+	struct Job
+	{
+		std::string filename;
+		std::vector<Image> faces;
+		bool ok;
+		CubeCut cut;
+		Done done;
+		CubeDone cube_done;
+
+		std::unique_ptr<gl::texture_2d> texture;
+		std::unique_ptr<gl::texture_cube_map> cube;
+		size_t face, row;
+		GLsync fence;
+	};
+
+	void Decode(std::shared_ptr<Job> job);
+	void Begin(Job &job);
+	size_t Upload(Job &job, size_t offset, size_t room);
+	void Finish(Job &job);
+
+	std::mutex mutex;
+	std::deque< std::shared_ptr<Job> > decoded;
+	std::shared_ptr<Job> streaming;
+	std::deque< std::shared_ptr<Job> > uploading;
+	std::unique_ptr<gl::pixel_unpack_buffer> staging;
+	GLsync staged[2];
+	Int half;
+	Int pending;
+
+	// Last, so its threads are joined before the queues go away.
+	utils::thread_pool workers;
+};
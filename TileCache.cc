@@ -0,0 +1,225 @@
+#include "TileCache.hh"
+#include "Terrain.hh"
+#include "cstring"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+
+TileCache::TileCache() : map(nullptr), length(0), data(nullptr), size(0), tile_shift(0), tiles_x(0)
+{
+    memset(&header, 0, sizeof(header));
+}
+TileCache::~TileCache() { Close(); }
+
+bool TileCache::Open(const Char *filename)
+{
+    Close();
+
+    Int fd = open(filename, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+       memcmp(header.magic, TILE_MAGIC, 4) != 0)
+    {
+        close(fd);
+        memset(&header, 0, sizeof(header));
+
+        std::ifstream ifs(filename, std::ios::binary);
+        flat.resize(MAP_SIZE);
+        if(!ifs.read((Char*)flat.data(), MAP_SIZE)) { flat.clear(); return false; }
+        data       = flat.data();
+        size       = MAP_X;
+        tile_shift = 10;
+        tiles_x    = 1;
+        resident.assign(1, true);
+        dirty.assign(1, false);
+        bad.assign(1, false);
+        return true;
+    }
+
+    if((header.version != TILE_VERSION && header.version != TILE_BAKED) || header.tile_shift < 6 ||
+       header.tile_shift > 15 || (header.size & (header.size-1)) != 0 || header.size < (1u << header.tile_shift))
+    {
+        close(fd);
+        return false;
+    }
+
+    // Every section has to lie inside the file, after the tiles.
+    size_t tile_bytes = (size_t)1 << (2*header.tile_shift);
+    size_t tiles = (size_t)(header.size >> header.tile_shift) * (header.size >> header.tile_shift);
+    size_t file = st.st_size, end = TILE_HEADER + tiles*tile_bytes;
+    auto fits = [&](uint64_t offset, uint64_t bytes) { return offset >= end && offset <= file && bytes <= file - offset; };
+    bool ok = file >= end;
+    if(ok && header.version == TILE_BAKED)
+        ok = header.pyramid_leaf > 0 && header.pyramid_count > 0 &&
+             fits(header.normals, tiles*tile_bytes*4) && fits(header.checksums, tiles*8) &&
+             fits(header.pyramid, (uint64_t)header.pyramid_count*2);
+    if(!ok)
+    {
+        std::cerr << filename << ": tile file is truncated or its sections are out of range" << std::endl;
+        close(fd);
+        memset(&header, 0, sizeof(header));
+        return false;
+    }
+
+    length = st.st_size;
+    void *m = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED) return false;
+
+    map        = (GLUbyte*)m;
+    data       = map + TILE_HEADER;
+    size       = header.size;
+    tile_shift = header.tile_shift;
+    tiles_x    = size >> tile_shift;
+    resident.assign(tiles, false);
+    dirty.assign(tiles, false);
+    bad.assign(tiles, false);
+    lru_pos.assign(tiles, lru.end());
+    madvise(map + TILE_HEADER, tiles*tile_bytes, MADV_RANDOM);
+
+    if(header.version == TILE_BAKED)
+    {
+        TileHeader h = header;
+        h.header_checksum = 0;
+        uint64_t sum = Checksum(&h, sizeof(h));
+        sum = Checksum(map + header.checksums, tiles*8, sum);
+        sum = Checksum(map + header.pyramid, header.pyramid_count*2, sum);
+        if(sum != header.header_checksum)
+        {
+            std::cerr << filename << ": baked terrain header checksum mismatch" << std::endl;
+            Close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void TileCache::Close()
+{
+    if(map) munmap(map, length);
+    map = nullptr;
+    length = 0;
+    data = nullptr;
+    flat.clear();
+    memset(&header, 0, sizeof(header));
+    lru.clear();
+    lru_pos.clear();
+    resident.clear();
+    dirty.clear();
+    bad.clear();
+    size = tile_shift = tiles_x = 0;
+}
+
+bool TileCache::Convert(const Char *raw, Int size, const Char *filename, Int tile_shift)
+{
+    Int tile = 1 << tile_shift;
+    if(tile_shift < 6 || (size & (size-1)) != 0 || size < tile) return false;
+
+    std::ifstream ifs(raw, std::ios::binary);
+    std::ofstream ofs(filename, std::ios::binary);
+    if(!ifs || !ofs) return false;
+
+    std::vector<Char> page(TILE_HEADER, 0);
+    TileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TILE_MAGIC, 4);
+    header.version    = TILE_VERSION;
+    header.size       = size;
+    header.tile_shift = tile_shift;
+    memcpy(page.data(), &header, sizeof(header));
+    ofs.write(page.data(), TILE_HEADER);
+
+    // One band of tile rows is read at a time, then written out tile by tile.
+    std::vector<Char> band((size_t)tile * size);
+    for(Int tz = 0; tz < size / tile; tz++)
+    {
+        if(!ifs.read(band.data(), band.size())) return false;
+        for(Int tx = 0; tx < size / tile; tx++)
+            for(Int z = 0; z < tile; z++)
+                ofs.write(&band[(size_t)z*size + tx*tile], tile);
+    }
+    return (bool)ofs;
+}
+
+bool TileCache::Focus(Float x, Float z, Float radius, std::vector<Int> &loaded, std::vector<Int> &evicted)
+{
+    if(!map) return true;
+
+    Int tx0 = std::max(0, (Int)(x - radius) >> tile_shift), tx1 = std::min(tiles_x-1, (Int)(x + radius) >> tile_shift);
+    Int tz0 = std::max(0, (Int)(z - radius) >> tile_shift), tz1 = std::min(tiles_x-1, (Int)(z + radius) >> tile_shift);
+
+    size_t tile_bytes = (size_t)1 << (2*tile_shift);
+    Int focused = 0;
+    bool intact = true;
+    for(Int tz = tz0; tz <= tz1; tz++)
+    {
+        for(Int tx = tx0; tx <= tx1; tx++)
+        {
+            Int t = tz*tiles_x + tx;
+            focused++;
+            if(resident[t])
+            {
+                lru.splice(lru.begin(), lru, lru_pos[t]);
+                continue;
+            }
+            if(!Verify(t))
+            {
+                intact = false;
+                continue;
+            }
+            madvise(map + TILE_HEADER + t*tile_bytes, tile_bytes, MADV_WILLNEED);
+            lru.push_front(t);
+            lru_pos[t] = lru.begin();
+            resident[t] = true;
+            loaded.push_back(t);
+        }
+    }
+
+    while((Int)lru.size() > std::max(focused, TILE_CACHE))
+    {
+        Int t = lru.back();
+        Release(t);
+        evicted.push_back(t);
+    }
+    return intact;
+}
+
+void TileCache::Drop(Int tile)
+{
+    if(!map || resident[tile] || dirty[tile]) return;
+    size_t tile_bytes = (size_t)1 << (2*tile_shift);
+    madvise(map + TILE_HEADER + tile*tile_bytes, tile_bytes, MADV_DONTNEED);
+    if(header.version == TILE_BAKED)
+        madvise(map + header.normals + tile*tile_bytes*4, tile_bytes*4, MADV_DONTNEED);
+}
+
+bool TileCache::Verify(Int tile)
+{
+    if(header.version != TILE_BAKED || dirty[tile]) return true;
+    if(bad[tile]) return false;
+
+    size_t tile_bytes = (size_t)1 << (2*tile_shift);
+    uint64_t sum = Checksum(map + TILE_HEADER + tile*tile_bytes, tile_bytes);
+    sum = Checksum(map + header.normals + tile*tile_bytes*4, tile_bytes*4, sum);
+    if(sum == ((const uint64_t*)(map + header.checksums))[tile]) return true;
+
+    std::cerr << "baked terrain tile " << tile << " checksum mismatch" << std::endl;
+    bad[tile] = true;
+    return false;
+}
+
+uint64_t TileCache::Checksum(const void *data, size_t length, uint64_t seed)
+{
+    return utils::fnv1a(data, length, seed);
+}
+
+void TileCache::Release(Int tile)
+{
+    lru.erase(lru_pos[tile]);
+    lru_pos[tile] = lru.end();
+    resident[tile] = false;
+    Drop(tile);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Definitions.hh"
+#include "utils/hash.hh"
+#include "list"
+
+#define TILE_MAGIC   "EXTL"
+#define TILE_VERSION (1)
+#define TILE_BAKED   (2)
+#define TILE_HEADER  (4096)
+#define TILE_SHIFT   (8)
+#define TILE_CACHE   (64)
+
+// A tiled heightmap file is a TILE_HEADER sized header page followed by
+// square tiles of (1 << tile_shift)^2 bytes, tile rows first. A baked file
+// (TILE_BAKED) appends the derived data, each section at the offset stored
+// in the header: per-vertex normals in the same tile layout (4 bytes per
+// vertex), one checksum per tile over its heights and normals, and the
+// min/max pyramid levels. header_checksum covers the header itself, the
+// checksum table and the pyramid.
+struct TileHeader
+{
+	Char     magic[4];
+	uint32_t version;
+	uint32_t size;
+	uint32_t tile_shift;
+
+	uint64_t normals;
+	uint64_t checksums;
+	uint64_t pyramid;
+	uint32_t pyramid_leaf;
+	uint32_t pyramid_count;
+	uint64_t header_checksum;
+};
+
+class TileCache
+{
+public:
+	TileCache();
+	~TileCache();
+
+	// Maps a tiled file, or reads a plain MAP_X*MAP_X raw heightmap as one
+	// tile that stays resident.
+	bool Open(const Char *filename);
+	void Close();
+	static bool Convert(const Char *raw, Int size, const Char *filename, Int tile_shift = TILE_SHIFT);
+	// utils::fnv1a, the sum stored in baked files.
+	static uint64_t Checksum(const void *data, size_t length, uint64_t seed = utils::fnv_offset);
+
+	// Keeps the tiles within radius of (x, z) resident and evicts the least
+	// recently focused ones beyond TILE_CACHE. A baked tile is checked
+	// against its checksum the first time it comes in; one that fails is
+	// marked Bad and refused from then on without being hashed again.
+	// Returns false if a tile in range is refused.
+	bool Focus(Float x, Float z, Float radius, std::vector<Int> &loaded, std::vector<Int> &evicted);
+	void Drop(Int tile);
+
+	// The file is mapped copy-on-write, so edits stay in memory. An edited
+	// tile keeps its pages and skips the checksum from then on.
+	GLUbyte* Edit(Int tile) { dirty[tile] = true; return data; }
+	void* EditSection(uint64_t offset) { return map + offset; }
+
+	const GLUbyte* Data() const { return data; }
+	Int  Size()      const { return size; }
+	Int  TileShift() const { return tile_shift; }
+	Int  TilesX()    const { return tiles_x; }
+	bool Paged()     const { return map != nullptr; }
+	bool Baked()     const { return map && header.version == TILE_BAKED; }
+	const TileHeader& Header() const { return header; }
+	const void* Section(uint64_t offset) const { return map + offset; }
+	bool Resident(Int tile) const { return resident[tile]; }
+	bool Bad(Int tile) const { return bad[tile]; }
+
+private:
+	std::vector<GLUbyte> flat;
+	GLUbyte *map;
+	size_t   length;
+	GLUbyte *data;
+	TileHeader header;
+
+	Int size;
+	Int tile_shift;
+	Int tiles_x;
+
+	std::list<Int> lru;
+	std::vector<std::list<Int>::iterator> lru_pos;
+	std::vector<bool> resident;
+	std::vector<bool> dirty;
+	std::vector<bool> bad;
+
+	void Release(Int tile);
+	bool Verify(Int tile);
+};
@@ -0,0 +1,98 @@
+#include "UniformRing.hh"
+#include "cstring"
+
+UniformRing::UniformRing() : mapped(nullptr), region(0), head(0), align(256), stalls(0), overflowed(false)
+{
+    for(GLsync &fence : fences) fence = 0;
+}
+
+UniformRing::~UniformRing()
+{
+    for(GLsync fence : fences) if(fence) glDeleteSync(fence);
+    if(mapped) buffer->unmap();
+}
+
+static bool has_buffer_storage()
+{
+    GLint major = 0, minor = 0, count = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if(major > 4 || (major == 4 && minor >= 4)) return true;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for(GLint i = 0; i < count; i++)
+    {
+        const GLubyte *name = glGetStringi(GL_EXTENSIONS, i);
+        if(name && strcmp(reinterpret_cast<const Char*>(name), "GL_ARB_buffer_storage") == 0) return true;
+    }
+    return false;
+}
+
+bool UniformRing::Create()
+{
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    if(align <= 0 || RING_FRAME_BYTES % align)
+    {
+        std::cerr << "UniformRing: unusable uniform buffer alignment " << align << std::endl;
+        return false;
+    }
+
+    const GLsizeiptr size = (GLsizeiptr)RING_FRAME_BYTES * RING_FRAMES;
+    buffer.reset(new gl::uniform_buffer);
+    if(has_buffer_storage())
+    {
+        // Coherent, so writes need no flush; the fences keep the GPU and
+        // the CPU off each other's region.
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        buffer->storage(size, nullptr, flags);
+        mapped = static_cast<uint8_t*>(buffer->map(0, size, flags));
+        buffer->unbind();
+        if(!mapped)
+        {
+            // Immutable storage can't take glBufferData; start over with a
+            // fresh buffer object.
+            std::cerr << "UniformRing: persistent map failed, using glBufferSubData" << std::endl;
+            buffer.reset(new gl::uniform_buffer);
+        }
+    }
+    if(!mapped) buffer->data(size, nullptr, GL_STREAM_DRAW);
+    return glGetError() == GL_NO_ERROR;
+}
+
+void UniformRing::BeginFrame(const FrameUniforms &frame)
+{
+    GLsync &fence = fences[region];
+    if(fence)
+    {
+        if(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            stalls++;
+            while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+    head = (GLintptr)region * RING_FRAME_BYTES;
+    Bind(FRAME_BLOCK, &frame, sizeof(frame));
+}
+
+void UniformRing::EndFrame()
+{
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    region = (region + 1) % RING_FRAMES;
+}
+
+void UniformRing::Bind(GLuint index, const void *data, GLsizeiptr size)
+{
+    if(!buffer) return;
+    GLintptr end = (GLintptr)(region + 1) * RING_FRAME_BYTES;
+    if(head + size > end)
+    {
+        if(!overflowed) std::cerr << "UniformRing: more than " << RING_FRAME_BYTES << " bytes in a frame" << std::endl;
+        overflowed = true;
+        return;
+    }
+    if(mapped) memcpy(mapped + head, data, size);
+    else buffer->sub_data(head, size, data);
+    buffer->bind_range(index, head, size);
+    head += (size + align - 1) / align * align;
+}
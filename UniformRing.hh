@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Definitions.hh"
+#include "utils/gl_elems.hh"
+#include "memory"
+
+#define RING_FRAMES      3
+#define RING_FRAME_BYTES (256 << 10)
+
+// Binding points of the shared blocks; Shader attaches any block named
+// "Frame" or "Draw" to them when it reflects a program.
+#define FRAME_BLOCK 0
+#define DRAW_BLOCK  1
+
+// std140 layout of the Frame block; FRAME_BLOCK_GLSL must stay in step.
+struct FrameUniforms
+{
+	Float projection[16];
+	Float view[16];
+	Float eye[4];
+	Float sun[4];    // towards the sun
+	Float fog[4];    // rgb colour, a density
+	Float player[4];
+};
+
+#define FRAME_BLOCK_GLSL \
+	"layout(std140) uniform Frame\n" \
+	"{\n" \
+	"    mat4 projection;\n" \
+	"    mat4 view;\n" \
+	"    vec4 eye;\n" \
+	"    vec4 sun;\n" \
+	"    vec4 fog;\n" \
+	"    vec4 player;\n" \
+	"} frame;\n"
+
+// Feeds uniform blocks from one buffer split into RING_FRAMES regions. A
+// frame writes its Frame block and any Draw blocks into the next region and
+// binds them by range, so every program sees the same data without a
+// re-upload after a switch. A region is reused only once the fence set at
+// the end of its frame has signalled. The buffer stays mapped when the
+// driver has buffer storage; otherwise blocks go in with glBufferSubData.
+class UniformRing
+{
+public:
+	UniformRing();
+	~UniformRing();
+
+	bool Create();
+	void BeginFrame(const FrameUniforms &frame);
+	// T is a std140 struct matching the program's Draw block.
+	template<typename T>
+	void Draw(const T &block) { Bind(DRAW_BLOCK, &block, sizeof(T)); }
+	void Draw(const void *block, GLsizeiptr size) { Bind(DRAW_BLOCK, block, size); }
+	void EndFrame();
+
+	bool Persistent() const { return mapped != nullptr; }
+	// Frames that had to wait for the GPU to release their region.
+	Int  Stalls() const { return stalls; }
+
+private:
+	void Bind(GLuint index, const void *data, GLsizeiptr size);
+
+	std::unique_ptr<gl::uniform_buffer> buffer;
+	uint8_t *mapped;
+	GLsync fences[RING_FRAMES];
+	Int region;
+	GLintptr head;
+	GLint align;
+	Int stalls;
+	bool overflowed;
+};
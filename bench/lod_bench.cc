@@ -0,0 +1,155 @@
+// Flies a fixed camera path over a map and reports the triangles
+// Terrain::Display submits and the frame time, once with every chunk at
+// full resolution (SetLodError(0)) as the baseline and once with the
+// screen-space error LOD. Frames are timed from Display to glFinish; paging
+// in Focus happens before the clock starts.
+//
+//     lod_bench <map> [shader manifest]
+
+#include "../Terrain.hh"
+#include "../Shader.hh"
+#include "SDL.h"
+#include "chrono"
+#include "cstdio"
+
+#define BENCH_WIDTH  (1280)
+#define BENCH_HEIGHT (720)
+#define BENCH_FRAMES (600)
+#define BENCH_FOV    (60.0f)
+#define BENCH_ALTITUDE (12.0f)
+
+// Chunk vertices were a float xyz and a 4-byte normal before PackVertex.
+#define UNPACKED_VERTEX (16)
+
+struct Run { Float error; double ms, worst_ms; double triangles; bool intact; };
+
+static void print_mesh(const Char *when, size_t bytes)
+{
+    printf("%s: %.1f MB of chunk vertices, %.1f MB at %d bytes a vertex\n", when, bytes / 1048576.0,
+           bytes / sizeof(Vertex) * UNPACKED_VERTEX / 1048576.0, UNPACKED_VERTEX);
+}
+
+// Frame f of the path: a loop around the map centre at a fixed height above
+// the ground, looking slightly down and turning once per loop. False if
+// a tile on the way failed its checksum.
+static bool place_camera(Terrain &terrain, Int size, Int f, Float far)
+{
+    const Float pi = 3.14159265f;
+    Float a = 2*pi*f / BENCH_FRAMES;
+    Float r = size * 0.3f;
+    Float x = size*0.5f + r*cos(a), z = size*0.5f + r*sin(a);
+    Float y = terrain.GetHeight(x, z) + BENCH_ALTITUDE;
+    bool intact = terrain.Focus(x, z, far);
+
+    Float top = 0.5f*tan(BENCH_FOV*pi/360.0f);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glFrustum(-top*BENCH_WIDTH/BENCH_HEIGHT, top*BENCH_WIDTH/BENCH_HEIGHT, -top, top, 0.5, far);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glRotatef(15.0f, 1, 0, 0);
+    glRotatef(a*180.0f/pi, 0, 1, 0);
+    glTranslatef(-x, -y, -z);
+    return intact;
+}
+
+static Run fly(Terrain &terrain, Int size, Float error)
+{
+    Float far = size * 0.75f;
+    Run run = { error, 0, 0, 0, true };
+    terrain.SetLodError(error);
+    for(Int f = 0; f < BENCH_FRAMES; f++)
+    {
+        run.intact &= place_camera(terrain, size, f, far);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        auto start = std::chrono::steady_clock::now();
+        terrain.Display();
+        glFinish();
+        std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        run.ms += ms.count();
+        run.worst_ms = std::max(run.worst_ms, ms.count());
+        run.triangles += terrain.Submitted();
+    }
+    run.ms /= BENCH_FRAMES;
+    run.triangles /= BENCH_FRAMES;
+    return run;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <map> [shader manifest]" << std::endl;
+        return 1;
+    }
+
+    if(SDL_Init(SDL_INIT_VIDEO) != 0)
+    {
+        std::cerr << "SDL_Init: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_COMPATIBILITY);
+    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+    SDL_Window *window = SDL_CreateWindow("lod_bench", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                          BENCH_WIDTH, BENCH_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    SDL_GLContext context = window ? SDL_GL_CreateContext(window) : nullptr;
+    if(!context)
+    {
+        std::cerr << "GL context: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    SDL_GL_SetSwapInterval(0);
+    glewExperimental = GL_TRUE;
+    if(glewInit() != GLEW_OK)
+    {
+        std::cerr << "glewInit failed" << std::endl;
+        return 1;
+    }
+    glViewport(0, 0, BENCH_WIDTH, BENCH_HEIGHT);
+    glEnable(GL_DEPTH_TEST);
+
+    if(argc > 2)
+    {
+        Shader shader;
+        if(shader.Load(argv[2]))
+            std::cout << argv[2] << ": " << shader.Programs() << " programs, " << shader.Cached()
+                      << " from the binary cache, loaded in " << shader.LoadTime() << " ms" << std::endl;
+    }
+
+    {
+        Terrain terrain;
+        terrain.Load(argv[1]);
+        Int size = terrain.Size();
+        if(!size)
+        {
+            std::cerr << argv[1] << ": cannot load map" << std::endl;
+            return 1;
+        }
+        std::cout << argv[1] << ": loaded in " << terrain.LoadTime() << " ms" << std::endl;
+        print_mesh("after load", terrain.MeshBytes());
+        for(Int level = 0; level < LOD_LEVELS; level++)
+        {
+            Float acmr[2], atvr[2];
+            terrain.LodCacheStats(level, acmr[0], atvr[0], acmr[1], atvr[1]);
+            printf("LOD %d: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", level, acmr[0], acmr[1], atvr[0], atvr[1]);
+        }
+
+        // Pages in and warms up the path.
+        if(!fly(terrain, size, LOD_PIXELS).intact)
+            std::cerr << argv[1] << ": tiles on the path failed their checksum and are not drawn" << std::endl;
+        Run runs[2] = { fly(terrain, size, 0.0f), fly(terrain, size, LOD_PIXELS) };
+        std::cout << "error px  triangles/frame  ms/frame  worst ms" << std::endl;
+        for(const Run &run : runs)
+            printf("%8.1f  %15.0f  %8.3f  %8.3f\n", run.error, run.triangles, run.ms, run.worst_ms);
+        printf("LOD submits %.1f%% of the triangles in %.1f%% of the time\n",
+               100.0*runs[1].triangles/runs[0].triangles, 100.0*runs[1].ms/runs[0].ms);
+        print_mesh("after the path", terrain.MeshBytes());
+    }
+
+    SDL_GL_DeleteContext(context);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return 0;
+}
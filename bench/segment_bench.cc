@@ -0,0 +1,205 @@
+// Times Terrain::GetSegmentIntersection, which walks the cells a segment
+// crosses, against the rectangle scan it replaced, which tests every
+// triangle in the xz bounding box of the segment's end cells. Both use the
+// same triangle arithmetic, so their answers agree except where a segment
+// ends exactly on a cell edge: the walk then also tests the cell across it,
+// whose triangle can catch a hit on the shared edge that the rounding of
+// the end cell's own test misses.
+//
+//     segment_bench <map>
+
+#include "../Terrain.hh"
+#include "chrono"
+#include "cmath"
+#include "cstdio"
+#include "random"
+
+#define SEGMENTS (1 << 20)   // cells per configuration, spread over its segments
+
+// The triangle build and segment test of Terrain, kept here verbatim so the
+// reference does not depend on what it is measured against.
+struct Reference
+{
+    TileCache tiles;
+    const GLUbyte *heights;
+    Int size, tile_shift, tiles_x;
+
+    bool Open(const Char *filename)
+    {
+        if(!tiles.Open(filename)) return false;
+        heights = tiles.Data();
+        size = tiles.Size();
+        tile_shift = tiles.TileShift();
+        tiles_x = tiles.TilesX();
+        return true;
+    }
+
+    Float Height(Int x, Int z)
+    {
+        Int t = (z >> tile_shift)*tiles_x + (x >> tile_shift), m = (1 << tile_shift) - 1;
+        return heights[((size_t)t << (2*tile_shift)) + ((z & m) << tile_shift) + (x & m)] / FACTOR;
+    }
+
+    void ComputeTriangle(Int i, Int j, Tri &tri)
+    {
+        Int x = i/2;
+        Coord triangle[3];
+        if(i%2 == 0)
+        {
+            triangle[0].x = x;   triangle[0].y = Height(x,   j  );  triangle[0].z = j;
+            triangle[1].x = x;   triangle[1].y = Height(x,   j+1);  triangle[1].z = j+1;
+            triangle[2].x = x+1; triangle[2].y = Height(x+1, j  );  triangle[2].z = j;
+        }
+        else
+        {
+            triangle[0].x = x;   triangle[0].y = Height(x,   j+1);  triangle[0].z = j+1;
+            triangle[1].x = x+1; triangle[1].y = Height(x+1, j  );  triangle[1].z = j;
+            triangle[2].x = x+1; triangle[2].y = Height(x+1, j+1);  triangle[2].z = j+1;
+        }
+        for(Int k = 0; k < 3; k++) tri.vertices[k] = triangle[k];
+
+        Vec a, b, n;
+        if(i%2 != 0) std::swap(triangle[2], triangle[0]);
+        a.x = triangle[1].x - triangle[0].x;  a.y = triangle[1].y - triangle[0].y;  a.z = triangle[1].z - triangle[0].z;
+        b.x = triangle[2].x - triangle[1].x;  b.y = triangle[2].y - triangle[1].y;  b.z = triangle[2].z - triangle[1].z;
+        n.x = a.y * b.z - a.z * b.y;
+        n.y = a.z * b.x - a.x * b.z;
+        n.z = a.x * b.y - a.y * b.x;
+        Float factor = sqrt( 1.0f/(n.x*n.x + n.y*n.y + n.z*n.z) );
+        tri.N.x = n.x*factor;  tri.N.y = n.y*factor;  tri.N.z = n.z*factor;
+    }
+
+    static bool CollisionCheck(const Coord &P, const Coord &Q, const Tri &tri, Float &lambda)
+    {
+        Vec V;
+        V.x = Q.x - P.x;
+        V.y = Q.y - P.y;
+        V.z = Q.z - P.z;
+
+        Float NV = tri.N.x*V.x + tri.N.y*V.y + tri.N.z*V.z;
+        if(NV == 0.0f) return false;
+
+        Float D = -(tri.N.x*tri.vertices[0].x + tri.N.y*tri.vertices[0].y + tri.N.z*tri.vertices[0].z);
+        lambda = -(tri.N.x*P.x + tri.N.y*P.y + tri.N.z*P.z + D) / NV;
+
+        if(lambda < 0.0f || lambda > 1.0f) return false;
+        Coord I;  I.x = P.x + lambda*V.x;  I.y = P.y + lambda*V.y;  I.z = P.z + lambda*V.z;
+
+        Float tri_orientation = (tri.vertices[0].x - tri.vertices[2].x) * (tri.vertices[1].z - tri.vertices[2].z)
+                                - (tri.vertices[0].z - tri.vertices[2].z) * (tri.vertices[1].x - tri.vertices[2].x);
+        Float ABIor = (tri.vertices[0].x - I.x) * (tri.vertices[1].z - I.z) - (tri.vertices[0].z - I.z) * (tri.vertices[1].x - I.x);
+        Float BCIor = (tri.vertices[1].x - I.x) * (tri.vertices[2].z - I.z) - (tri.vertices[1].z - I.z) * (tri.vertices[2].x - I.x);
+        Float CAIor = (tri.vertices[2].x - I.x) * (tri.vertices[0].z - I.z) - (tri.vertices[2].z - I.z) * (tri.vertices[0].x - I.x);
+        if( tri_orientation >= 0.0f && (ABIor < 0.0f  || BCIor < 0.0f || CAIor < 0.0f) )   return false;
+        if( tri_orientation < 0.0f && (ABIor >= 0.0f  || BCIor >= 0.0f || CAIor >= 0.0f) ) return false;
+        return true;
+    }
+
+    // Every triangle of the cells between the end points, clamped to the map.
+    Float GetSegmentIntersection(Float x, Float y, Float z, Float vx, Float vy, Float vz, Float dst)
+    {
+        Coord P = { x, y, z };
+        Coord Q = { x - dst*vx, y - dst*vy, z - dst*vz };
+
+        Int px = (Int)floor(P.x), pz = (Int)floor(P.z);
+        Int qx = (Int)floor(Q.x), qz = (Int)floor(Q.z);
+        if( (px < 0 && qx < 0) || (px > size-2 && qx > size-2) ) return 1.0f;
+        if( (pz < 0 && qz < 0) || (pz > size-2 && qz > size-2) ) return 1.0f;
+        Int x0 = std::max(std::min(px, qx), 0), x1 = std::min(std::max(px, qx), size-2);
+        Int z0 = std::max(std::min(pz, qz), 0), z1 = std::min(std::max(pz, qz), size-2);
+
+        Tri tri;
+        Float lambda, lowest_lambda = 1.0f;
+        for(Int j = z0; j <= z1; j++)
+            for(Int i = x0*2; i <= x1*2+1; i++)
+            {
+                ComputeTriangle(i, j, tri);
+                if(CollisionCheck(P, Q, tri, lambda) && lambda < lowest_lambda) lowest_lambda = lambda;
+            }
+        return lowest_lambda;
+    }
+};
+
+struct Segment { Float x, y, z, vx, vy, vz, dst; };
+
+template<typename F>
+Float time_ms(const std::vector<Segment> &segments, std::vector<Float> &lambda, F query)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(size_t n = 0; n < segments.size(); n++)
+    {
+        const Segment &s = segments[n];
+        lambda[n] = query(s.x, s.y, s.z, s.vx, s.vy, s.vz, s.dst);
+    }
+    std::chrono::duration<Float, std::milli> ms = std::chrono::steady_clock::now() - start;
+    return ms.count();
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <map>" << std::endl;
+        return 1;
+    }
+
+    Terrain terrain;
+    Reference reference;
+    if(!terrain.LoadHeights(argv[1]) || !reference.Open(argv[1]))
+    {
+        std::cerr << argv[1] << ": cannot load map" << std::endl;
+        return 1;
+    }
+    std::cout << argv[1] << ": " << reference.size << "^2, loaded in " << terrain.LoadTime() << " ms" << std::endl;
+
+    // Segments start above the ground and point down at the given pitch
+    // with a random heading, at most their height drop above the ground.
+    const Float lengths[] = { 2, 8, 32, 128, 512 };
+    const Float pitches[] = { 5, 20, 45, 90 };
+    const Float pi = 3.14159265f;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<Float> unit(0.0f, 1.0f);
+    Float margin = 2.0f;
+
+    std::cout << "length  pitch  segments  rect ms    walk ms    speedup  hits  differ" << std::endl;
+    for(Float length : lengths)
+        for(Float pitch : pitches)
+        {
+            Float p = pitch*pi/180.0f;
+            Float reach = length*cos(p);
+            Int count = std::max(64, std::min(65536, (Int)(SEGMENTS / std::max(1.0f, reach*reach))));
+
+            std::vector<Segment> segments(count);
+            for(Segment &s : segments)
+            {
+                Float yaw = 2*pi*unit(rng);
+                s.x = margin + (reference.size-1 - 2*margin)*unit(rng);
+                s.z = margin + (reference.size-1 - 2*margin)*unit(rng);
+                s.y = terrain.GetHeight(s.x, s.z) + length*sin(p)*unit(rng);
+                s.vx = -cos(p)*cos(yaw);
+                s.vy = sin(p);
+                s.vz = -cos(p)*sin(yaw);
+                s.dst = length;
+            }
+
+            std::vector<Float> expected(count), lambda(count);
+            Float rect = time_ms(segments, expected, [&](Float x, Float y, Float z, Float vx, Float vy, Float vz, Float dst)
+            {
+                return reference.GetSegmentIntersection(x, y, z, vx, vy, vz, dst);
+            });
+            Float walk = time_ms(segments, lambda, [&](Float x, Float y, Float z, Float vx, Float vy, Float vz, Float dst)
+            {
+                return terrain.GetSegmentIntersection(x, y, z, vx, vy, vz, dst);
+            });
+
+            Int hits = 0, differ = 0;
+            for(Int n = 0; n < count; n++)
+            {
+                hits += expected[n] < 1.0f;
+                differ += lambda[n] != expected[n];
+            }
+            printf("%6.0f  %5.0f  %8d  %9.2f  %9.2f  %7.1fx  %4.0f%%  %d\n", length, pitch, count,
+                   rect, walk, rect / walk, 100.0f*hits/count, differ);
+        }
+    return 0;
+}
@@ -0,0 +1,187 @@
+// Runs every SIMD kernel set the CPU has against the scalar one on a
+// generated heightmap and fails unless the results match bit for bit.
+
+#include "../Collision.hh"
+#include "cstring"
+#include "random"
+
+#define GRID_SIZE  (512)
+#define GRID_SHIFT (7)
+#define ROUNDS     (20000)
+
+static Int failures = 0;
+
+static void expect(bool ok, const Char *kernel, const Char *what)
+{
+    if(ok) return;
+    std::cerr << kernel << ": " << what << " differs from scalar" << std::endl;
+    failures++;
+}
+
+static bool same(const void *a, const void *b, size_t bytes) { return memcmp(a, b, bytes) == 0; }
+
+// Rolling hills plus noise, in the tile layout of Terrain::Index.
+static std::vector<GLUbyte> make_grid(HeightGrid &grid)
+{
+    grid.size = GRID_SIZE;
+    grid.tile_shift = GRID_SHIFT;
+    grid.tiles_x = GRID_SIZE >> GRID_SHIFT;
+    std::vector<GLUbyte> data((size_t)GRID_SIZE*GRID_SIZE);
+    std::mt19937 rng(1);
+    Int m = (1 << GRID_SHIFT) - 1;
+    for(Int z = 0; z < GRID_SIZE; z++)
+        for(Int x = 0; x < GRID_SIZE; x++)
+        {
+            Int t = (z >> GRID_SHIFT)*grid.tiles_x + (x >> GRID_SHIFT);
+            Float h = 128 + 70*sin(x*0.031f)*cos(z*0.027f) + (rng() % 24);
+            data[((size_t)t << (2*GRID_SHIFT)) + ((z & m) << GRID_SHIFT) + (x & m)] = (GLUbyte)std::min(255.0f, std::max(0.0f, h));
+        }
+    grid.data = data.data();
+    return data;
+}
+
+static Float height(const HeightGrid &g, Int x, Int z)
+{
+    Int t = (z >> g.tile_shift)*g.tiles_x + (x >> g.tile_shift), m = (1 << g.tile_shift) - 1;
+    return g.data[((size_t)t << (2*g.tile_shift)) + ((z & m) << g.tile_shift) + (x & m)] / FACTOR;
+}
+
+// Triangle k of cell (x, z), built like Terrain::ComputeTriangle.
+static Tri cell_triangle(const HeightGrid &g, Int x, Int z, Int k)
+{
+    Coord v[3];
+    if(k == 0) { v[0] = {(Float)x, height(g, x, z), (Float)z};   v[1] = {(Float)x, height(g, x, z+1), (Float)z+1};   v[2] = {(Float)x+1, height(g, x+1, z), (Float)z}; }
+    else       { v[0] = {(Float)x, height(g, x, z+1), (Float)z+1}; v[1] = {(Float)x+1, height(g, x+1, z), (Float)z}; v[2] = {(Float)x+1, height(g, x+1, z+1), (Float)z+1}; }
+    Tri tri;
+    for(Int i = 0; i < 3; i++) tri.vertices[i] = v[i];
+    tri.center = { (v[0].x+v[1].x+v[2].x)/3, (v[0].y+v[1].y+v[2].y)/3, (v[0].z+v[1].z+v[2].z)/3 };
+    if(k) std::swap(v[0], v[2]);
+    Vec a = { v[1].x-v[0].x, v[1].y-v[0].y, v[1].z-v[0].z }, b = { v[2].x-v[1].x, v[2].y-v[1].y, v[2].z-v[1].z };
+    Vec n = { a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x };
+    Float f = sqrt(1.0f/(n.x*n.x + n.y*n.y + n.z*n.z));
+    tri.N = { n.x*f, n.y*f, n.z*f };
+    return tri;
+}
+
+struct Results
+{
+    std::vector<Int> masks;
+    std::vector<Float> lambdas;
+    std::vector<Coord> centers;
+    std::vector<Float> heights;
+    std::vector<Normal> normals;
+    std::vector<Int> visible;
+};
+
+// Same seed for every kernel set, so each sees the same inputs.
+static void run(const HeightGrid &grid, Results &r)
+{
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<Float> unit(0.0f, 1.0f);
+    auto coord = [&](Float lo, Float hi) { return lo + (hi - lo)*unit(rng); };
+
+    for(Int round = 0; round < ROUNDS; round++)
+    {
+        // Up to PACK_WIDTH triangles around one spot, as the walks gather them.
+        TriPack pack;
+        PackClear(pack);
+        Int cx = rng() % (GRID_SIZE-8), cz = rng() % (GRID_SIZE-8), n = 1 + rng() % PACK_WIDTH;
+        for(Int i = 0; i < n; i++) PackTriangle(pack, cell_triangle(grid, cx + i/2 % 4, cz + i/8, i % 2));
+
+        Coord P = { cx + coord(-2, 6), coord(0, 40), cz + coord(-2, 6) };
+        Coord Q = { cx + coord(-2, 6), coord(0, 40), cz + coord(-2, 6) };
+        if(round % 4 == 0) { Q.x = P.x; Q.z = P.z; }
+        Float lambda[PACK_WIDTH];
+        for(Float &l : lambda) l = -7.0f;
+        Int mask = PackSegment(pack, P, Q, lambda);
+        r.masks.push_back(mask);
+        for(Int k = 0; k < PACK_WIDTH; k++) if(mask & (1 << k)) r.lambdas.push_back(lambda[k]);
+
+        Coord S = { cx + coord(0, 4), height(grid, cx, cz) + coord(-1, 3), cz + coord(0, 4) };
+        Coord center[PACK_WIDTH];
+        mask = PackSphere(pack, S, coord(0.2f, 3.0f), center);
+        r.masks.push_back(mask);
+        for(Int k = 0; k < PACK_WIDTH; k++) if(mask & (1 << k)) r.centers.push_back(center[k]);
+    }
+
+    // Points across the map and beyond its edges, which clamp; the count
+    // is not a multiple of eight so the tail runs too.
+    const Int points = 4099;
+    std::vector<Float> x(points), z(points), y(points);
+    for(Int i = 0; i < points; i++) { x[i] = coord(-4, GRID_SIZE+4); z[i] = coord(-4, GRID_SIZE+4); }
+    GridHeights(grid, x.data(), z.data(), y.data(), points);
+    r.heights = y;
+
+    // Full rows including the borders, and odd runs inside a row.
+    std::vector<Normal> row(GRID_SIZE);
+    for(Int z = 0; z < GRID_SIZE; z += 37)
+    {
+        GridNormals(grid, 0, z, GRID_SIZE, row.data());
+        r.normals.insert(r.normals.end(), row.begin(), row.end());
+    }
+    for(Int z : { 0, 1, GRID_SIZE-1 })
+    {
+        Int x0 = rng() % 100, count = 1 + rng() % 300;
+        GridNormals(grid, x0, z, count, row.data());
+        r.normals.insert(r.normals.end(), row.begin(), row.begin() + count);
+    }
+
+    // Random boxes against a few random frusta.
+    const Int boxes = 1001;
+    BoxSet set;
+    for(auto *v : { &set.x0, &set.y0, &set.z0, &set.x1, &set.y1, &set.z1 }) v->resize(boxes);
+    for(Int i = 0; i < boxes; i++)
+    {
+        set.x0[i] = coord(-100, 100); set.x1[i] = set.x0[i] + coord(0, 20);
+        set.y0[i] = coord(-100, 100); set.y1[i] = set.y0[i] + coord(0, 20);
+        set.z0[i] = coord(-100, 100); set.z1[i] = set.z0[i] + coord(0, 20);
+    }
+    std::vector<Int> visible(boxes);
+    for(Int f = 0; f < 16; f++)
+    {
+        Float planes[6][4];
+        for(auto &p : planes) for(Float &c : p) c = coord(-1, 1);
+        for(auto &p : planes) p[3] = coord(0, 150);
+        Int count = CullBoxes(set, boxes, planes, visible.data());
+        r.visible.push_back(count);
+        r.visible.insert(r.visible.end(), visible.begin(), visible.begin() + count);
+    }
+}
+
+int main()
+{
+    HeightGrid grid;
+    std::vector<GLUbyte> data = make_grid(grid);
+
+    SetPackKernels("scalar");
+    Results reference;
+    run(grid, reference);
+
+    Int hits = 0;
+    for(Int m : reference.masks) hits += m != 0;
+    std::cout << "scalar: " << hits << " of " << reference.masks.size() << " packs hit, "
+              << reference.visible.size() << " culling results" << std::endl;
+
+    for(const Char *kernel : { "sse2", "avx2" })
+    {
+        if(!SetPackKernels(kernel))
+        {
+            std::cout << kernel << ": not available, skipped" << std::endl;
+            continue;
+        }
+        Int before = failures;
+        Results r;
+        run(grid, r);
+        expect(r.masks == reference.masks, kernel, "PackSegment/PackSphere hit mask");
+        expect(r.lambdas.size() == reference.lambdas.size() &&
+               same(r.lambdas.data(), reference.lambdas.data(), r.lambdas.size()*sizeof(Float)), kernel, "PackSegment lambda");
+        expect(r.centers.size() == reference.centers.size() &&
+               same(r.centers.data(), reference.centers.data(), r.centers.size()*sizeof(Coord)), kernel, "PackSphere center");
+        expect(same(r.heights.data(), reference.heights.data(), r.heights.size()*sizeof(Float)), kernel, "GridHeights");
+        expect(r.normals.size() == reference.normals.size() &&
+               same(r.normals.data(), reference.normals.data(), r.normals.size()*sizeof(Normal)), kernel, "GridNormals");
+        expect(r.visible == reference.visible, kernel, "CullBoxes");
+        std::cout << kernel << ": " << (failures > before ? "MISMATCH" : "bit-exact") << std::endl;
+    }
+    return failures ? 1 : 0;
+}
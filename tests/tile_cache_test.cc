@@ -0,0 +1,221 @@
+// Round-trips a generated heightmap through TileCache::Convert and
+// Terrain::Bake, then checks that TileCache::Open refuses damaged files.
+
+#include "../Collision.hh"
+#include "cstring"
+#include "random"
+#include "stdio.h"
+#include "unistd.h"
+
+#define MAP_SIDE   (512)
+#define MAP_SHIFT  (7)
+#define RAW_FILE   "tile_cache_test.raw"
+#define TILED_FILE "tile_cache_test.til"
+#define BAKED_FILE "tile_cache_test.bk2"
+#define BAD_FILE   "tile_cache_test.bad"
+
+static Int failures = 0;
+
+static void expect(bool ok, const Char *what)
+{
+    std::cout << (ok ? "ok:   " : "FAIL: ") << what << std::endl;
+    if(!ok) failures++;
+}
+
+static std::vector<GLUbyte> read_file(const Char *filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    return std::vector<GLUbyte>(std::istreambuf_iterator<Char>(ifs), std::istreambuf_iterator<Char>());
+}
+
+static void write_file(const Char *filename, const std::vector<GLUbyte> &bytes)
+{
+    std::ofstream ofs(filename, std::ios::binary);
+    ofs.write((const Char*)bytes.data(), bytes.size());
+}
+
+static size_t tiled(Int x, Int z, Int shift, Int tiles_x)
+{
+    Int t = (z >> shift)*tiles_x + (x >> shift), m = (1 << shift) - 1;
+    return ((size_t)t << (2*shift)) + ((z & m) << shift) + (x & m);
+}
+
+// Recomputes header_checksum the way Terrain::WriteBaked does, so that a
+// damaged field is caught by the check meant for it and not by the sum.
+// Sections outside the file are left alone; Open refuses those first.
+static void reseal(std::vector<GLUbyte> &file)
+{
+    TileHeader h;
+    memcpy(&h, file.data(), sizeof(h));
+    if(h.tile_shift > 15) return;
+    size_t tiles = (size_t)(h.size >> h.tile_shift) * (h.size >> h.tile_shift);
+    auto inside = [&](uint64_t offset, uint64_t bytes) { return offset <= file.size() && bytes <= file.size() - offset; };
+    if(!inside(h.checksums, tiles*8) || !inside(h.pyramid, (uint64_t)h.pyramid_count*2)) return;
+    h.header_checksum = 0;
+    uint64_t sum = TileCache::Checksum(&h, sizeof(h));
+    sum = TileCache::Checksum(&file[h.checksums], tiles*8, sum);
+    h.header_checksum = TileCache::Checksum(&file[h.pyramid], (size_t)h.pyramid_count*2, sum);
+    memcpy(file.data(), &h, sizeof(h));
+}
+
+// Opens the baked file with one header field changed.
+template<typename F>
+static bool open_patched(const std::vector<GLUbyte> &baked, F patch, bool sealed = true)
+{
+    std::vector<GLUbyte> file = baked;
+    TileHeader h;
+    memcpy(&h, file.data(), sizeof(h));
+    patch(h);
+    memcpy(file.data(), &h, sizeof(h));
+    if(sealed) reseal(file);
+    write_file(BAD_FILE, file);
+    TileCache cache;
+    return cache.Open(BAD_FILE);
+}
+
+int main()
+{
+    // Rolling hills plus noise, one byte per vertex, rows first.
+    std::vector<GLUbyte> raw((size_t)MAP_SIDE*MAP_SIDE);
+    std::mt19937 rng(1);
+    for(Int z = 0; z < MAP_SIDE; z++)
+        for(Int x = 0; x < MAP_SIDE; x++)
+            raw[(size_t)z*MAP_SIDE + x] = (GLUbyte)std::min(255.0f, std::max(0.0f, 128 + 90*sinf(x*0.023f)*cosf(z*0.019f) + (rng() % 32)));
+    write_file(RAW_FILE, raw);
+
+    // Convert, then Open: the same heights in the tile layout.
+    Int tiles_x = MAP_SIDE >> MAP_SHIFT, tile_bytes = 1 << (2*MAP_SHIFT);
+    expect(!TileCache::Convert(RAW_FILE, MAP_SIDE + 1, TILED_FILE, MAP_SHIFT), "Convert refuses a size that is not a power of two");
+    expect(TileCache::Convert(RAW_FILE, MAP_SIDE, TILED_FILE, MAP_SHIFT), "Convert writes a tiled file");
+    {
+        TileCache cache;
+        bool open = cache.Open(TILED_FILE);
+        expect(open && cache.Paged() && !cache.Baked() && cache.Size() == MAP_SIDE &&
+               cache.TileShift() == MAP_SHIFT && cache.TilesX() == tiles_x, "tiled file opens with its geometry");
+        bool same = open;
+        for(Int z = 0; same && z < MAP_SIDE; z++)
+            for(Int x = 0; x < MAP_SIDE; x++)
+                same &= cache.Data()[tiled(x, z, MAP_SHIFT, tiles_x)] == raw[(size_t)z*MAP_SIDE + x];
+        expect(same, "tiled heights match the raw map");
+    }
+
+    // Bake, then Open: normals and pyramid as the unbaked map computes them.
+    expect(Terrain::Bake(TILED_FILE, BAKED_FILE), "Bake writes a baked file");
+    std::vector<GLUbyte> baked = read_file(BAKED_FILE);
+    {
+        TileCache plain, cache;
+        bool open = plain.Open(TILED_FILE) && cache.Open(BAKED_FILE);
+        expect(open && cache.Baked(), "baked file opens");
+        if(!open) return 1;
+        const TileHeader &h = cache.Header();
+        expect(memcmp(cache.Data(), plain.Data(), (size_t)MAP_SIDE*MAP_SIDE) == 0, "baked heights match the tiled ones");
+
+        HeightGrid grid = { plain.Data(), MAP_SIDE, MAP_SHIFT, tiles_x };
+        std::vector<Normal> normals((size_t)MAP_SIDE*MAP_SIDE);
+        for(Int z = 0; z < MAP_SIDE; z++)
+            for(Int x = 0; x < MAP_SIDE; x += 1 << MAP_SHIFT)
+                GridNormals(grid, x, z, 1 << MAP_SHIFT, &normals[tiled(x, z, MAP_SHIFT, tiles_x)]);
+        expect(memcmp(cache.Section(h.normals), normals.data(), normals.size()*sizeof(Normal)) == 0, "baked normals match GridNormals");
+
+        // Leaves span their cells' corner vertices; each level above merges
+        // 2x2 nodes of the one below.
+        Int leaf = std::max(PYRAMID_LEAF, MAP_SIDE / MAP_X);
+        std::vector<MinMax> pyramid;
+        std::vector<Int> width;
+        for(Int w = (MAP_SIDE-1 + leaf-1) / leaf; ; w = (w+1) / 2)
+        {
+            width.push_back(w);
+            if(w == 1) break;
+        }
+        for(Int nz = 0; nz < width[0]; nz++)
+            for(Int nx = 0; nx < width[0]; nx++)
+            {
+                MinMax mm = { 255, 0 };
+                for(Int z = nz*leaf; z <= std::min((nz+1)*leaf, MAP_SIDE-1); z++)
+                    for(Int x = nx*leaf; x <= std::min((nx+1)*leaf, MAP_SIDE-1); x++)
+                    {
+                        GLUbyte v = raw[(size_t)z*MAP_SIDE + x];
+                        mm.lo = std::min(mm.lo, v);
+                        mm.hi = std::max(mm.hi, v);
+                    }
+                pyramid.push_back(mm);
+            }
+        for(size_t L = 1, below = 0; L < width.size(); below += width[L-1]*width[L-1], L++)
+            for(Int nz = 0; nz < width[L]; nz++)
+                for(Int nx = 0; nx < width[L]; nx++)
+                {
+                    MinMax mm = { 255, 0 };
+                    for(Int z = nz*2; z <= std::min(nz*2+1, width[L-1]-1); z++)
+                        for(Int x = nx*2; x <= std::min(nx*2+1, width[L-1]-1); x++)
+                        {
+                            const MinMax &c = pyramid[below + z*width[L-1] + x];
+                            mm.lo = std::min(mm.lo, c.lo);
+                            mm.hi = std::max(mm.hi, c.hi);
+                        }
+                    pyramid.push_back(mm);
+                }
+        expect((Int)h.pyramid_leaf == leaf && h.pyramid_count == pyramid.size() &&
+               memcmp(cache.Section(h.pyramid), pyramid.data(), pyramid.size()*sizeof(MinMax)) == 0, "baked pyramid matches the heights");
+
+        std::vector<Int> loaded, evicted;
+        expect(cache.Focus(MAP_SIDE/2, MAP_SIDE/2, MAP_SIDE, loaded, evicted) && (Int)loaded.size() == tiles_x*tiles_x,
+               "every baked tile passes its checksum");
+    }
+
+    // Files Open has to refuse.
+    {
+        std::vector<GLUbyte> file(baked.begin(), baked.end() - 1);
+        write_file(BAD_FILE, file);
+        TileCache cache;
+        expect(!cache.Open(BAD_FILE), "refuses a truncated baked file");
+        file.assign(baked.begin(), baked.begin() + TILE_HEADER + tile_bytes);
+        write_file(BAD_FILE, file);
+        expect(!cache.Open(BAD_FILE), "refuses a file truncated inside its tiles");
+    }
+    expect(open_patched(baked, [](TileHeader &) { }), "a resealed copy still opens");
+    expect(!open_patched(baked, [](TileHeader &h) { h.pyramid_leaf = 0; }), "refuses pyramid leaf 0");
+    expect(!open_patched(baked, [](TileHeader &h) { h.pyramid_count = 0; }), "refuses an empty pyramid");
+    {
+        // A leaf the pyramid was not built with passes TileCache but not
+        // Terrain, whose level layout no longer adds up to pyramid_count.
+        bool opens = open_patched(baked, [](TileHeader &h) { h.pyramid_leaf *= 2; });
+        Terrain terrain;
+        expect(opens && !terrain.LoadHeights(BAD_FILE) && terrain.Size() == 0, "Terrain refuses a pyramid leaf that does not fit the count");
+    }
+    expect(!open_patched(baked, [&](TileHeader &h) { h.normals = baked.size() - 16; }), "refuses normals past the end of the file");
+    expect(!open_patched(baked, [&](TileHeader &h) { h.pyramid = baked.size() + 1; }), "refuses a pyramid starting past the end");
+    expect(!open_patched(baked, [](TileHeader &h) { h.normals = TILE_HEADER; }), "refuses normals overlapping the tiles");
+    expect(!open_patched(baked, [](TileHeader &h) { h.checksums = ~0ull - 7; }), "refuses an offset that overflows");
+    expect(!open_patched(baked, [](TileHeader &h) { h.pyramid_count = ~0u; }), "refuses a pyramid size that overflows the file");
+    expect(!open_patched(baked, [](TileHeader &h) { h.tile_shift = 31; }), "refuses an out of range tile shift");
+    expect(!open_patched(baked, [](TileHeader &h) { h.pyramid_leaf ^= 1; }, false), "refuses a flipped header byte");
+    {
+        std::vector<GLUbyte> file = baked;
+        TileHeader h;
+        memcpy(&h, file.data(), sizeof(h));
+        file[h.pyramid + 3] ^= 0x10;
+        write_file(BAD_FILE, file);
+        TileCache cache;
+        expect(!cache.Open(BAD_FILE), "refuses a flipped pyramid byte");
+    }
+    {
+        // A flipped tile byte only shows when the tile comes in; the tile is
+        // refused for good and the others still load.
+        std::vector<GLUbyte> file = baked;
+        Int bad = tiles_x + 1;
+        file[TILE_HEADER + (size_t)bad*tile_bytes + 77] ^= 0x01;
+        write_file(BAD_FILE, file);
+        TileCache cache;
+        std::vector<Int> loaded, evicted;
+        bool open = cache.Open(BAD_FILE);
+        bool intact = open && cache.Focus(MAP_SIDE/2, MAP_SIDE/2, MAP_SIDE, loaded, evicted);
+        expect(open && !intact && cache.Bad(bad) && !cache.Resident(bad) && (Int)loaded.size() == tiles_x*tiles_x - 1,
+               "refuses a tile with a flipped byte");
+        loaded.clear();
+        expect(open && !cache.Focus(MAP_SIDE/2, MAP_SIDE/2, MAP_SIDE, loaded, evicted) && loaded.empty(),
+               "keeps refusing it");
+    }
+
+    for(const Char *f : { RAW_FILE, TILED_FILE, BAKED_FILE, BAD_FILE }) unlink(f);
+    return failures ? 1 : 0;
+}
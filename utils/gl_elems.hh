@@ -1,8 +1,10 @@
 #pragma once
 
+#include <array>
 #include <tuple>
 #include <vector>
 #include <string>
+#include <glm/glm.hpp>
 
 namespace gl
 {
@@ -105,6 +107,8 @@ namespace texture_format
 constexpr texture_format_desc rgb8{GL_RGB8, GL_RGB, GL_BYTE};
 constexpr texture_format_desc rgba8{GL_RGBA8, GL_RGBA, GL_BYTE};
 constexpr texture_format_desc rgb32f{GL_RGB32F, GL_RGB, GL_FLOAT};
+constexpr texture_format_desc r8{GL_R8, GL_RED, GL_UNSIGNED_BYTE};
+constexpr texture_format_desc rgba8ub{GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE};
 }
 
 struct texture_2d : basic_texture<GL_TEXTURE_2D>
@@ -123,6 +127,54 @@ struct texture_2d : basic_texture<GL_TEXTURE_2D>
                      0, tex_fmt.format(),
                      tex_fmt.type(), data);
     }
+
+    void sub_image
+            (
+                    GLint x,
+                    GLint y,
+                    GLsizei width,
+                    GLsizei height,
+                    texture_format_desc tex_fmt,
+                    const void *data,
+                    int level = 0
+            ) noexcept {
+        glTexSubImage2D(GL_TEXTURE_2D, level, x, y, width, height,
+                        tex_fmt.format(), tex_fmt.type(), data);
+    }
+};
+
+struct texture_cube_map : basic_texture<GL_TEXTURE_CUBE_MAP>
+{
+    void face_image
+            (
+                    GLenum face,
+                    GLsizei width,
+                    GLsizei height,
+                    texture_format_desc tex_fmt,
+                    const void *data = nullptr,
+                    int level = 0
+            ) noexcept {
+        glTexImage2D(face, level,
+                     tex_fmt.internal_format(),
+                     width, height,
+                     0, tex_fmt.format(),
+                     tex_fmt.type(), data);
+    }
+
+    void face_sub_image
+            (
+                    GLenum face,
+                    GLint x,
+                    GLint y,
+                    GLsizei width,
+                    GLsizei height,
+                    texture_format_desc tex_fmt,
+                    const void *data,
+                    int level = 0
+            ) noexcept {
+        glTexSubImage2D(face, level, x, y, width, height,
+                        tex_fmt.format(), tex_fmt.type(), data);
+    }
 };
 
 struct texture_3d : basic_texture<GL_TEXTURE_3D>
@@ -366,6 +418,18 @@ struct basic_buffer : object
         unbind();
     }
 
+    // Immutable storage; the only way to get a persistent mapping.
+    void storage(GLsizeiptr size, const GLvoid *data, GLbitfield flags) noexcept {
+        bind();
+        glBufferStorage(target, size, data, flags);
+        unbind();
+    }
+
+    // For indexed targets (uniform buffers): attaches a range to a binding point.
+    void bind_range(GLuint index, GLintptr offset, GLsizeiptr size) noexcept {
+        glBindBufferRange(target, index, name, offset, size);
+    }
+
     void sub_data(GLintptr offset, GLsizei size, const GLvoid *data) noexcept {
         bind();
         glBufferSubData(target, offset, size, data);
@@ -390,6 +454,8 @@ struct basic_buffer : object
 
 using vertex_buffer = basic_buffer<GL_ARRAY_BUFFER>;
 using index_buffer = basic_buffer<GL_ELEMENT_ARRAY_BUFFER>;
+using pixel_unpack_buffer = basic_buffer<GL_PIXEL_UNPACK_BUFFER>;
+using uniform_buffer = basic_buffer<GL_UNIFORM_BUFFER>;
 
 struct vertex_array : object
 {
@@ -432,10 +498,78 @@ struct glm_type_traits
     }
 
     static void set_uniform(unsigned location, const T &v) {
+        static_assert(sizeof(T) == 0, "no uniform setter for this type");
+    }
+};
+
+
+template<>
+struct glm_type_traits<int>
+{
+    static constexpr unsigned size() {
+        return sizeof(int);
+    }
+
+    static constexpr int gl_type() {
+        return GL_INT;
+    }
+
+    static void set_uniform(unsigned location, const int &v) {
+        glUniform1i(location, v);
+    }
+
+};
 
+template<>
+struct glm_type_traits<float>
+{
+    static constexpr unsigned size() {
+        return sizeof(float);
+    }
+
+    static constexpr int gl_type() {
+        return GL_FLOAT;
+    }
+
+    static void set_uniform(unsigned location, const float &v) {
+        glUniform1f(location, v);
     }
+
 };
 
+template<std::size_t arr_count>
+struct glm_type_traits<std::array<int, arr_count> >
+{
+    static constexpr unsigned size() {
+        return sizeof(int);
+    }
+
+    static constexpr int gl_type() {
+        return GL_INT;
+    }
+
+    static void set_uniform(unsigned location, const std::array<int, arr_count> &v) {
+        glUniform1iv(location, arr_count, v.data());
+    }
+
+};
+
+template<std::size_t arr_count>
+struct glm_type_traits<std::array<float, arr_count> >
+{
+    static constexpr unsigned size() {
+        return sizeof(float);
+    }
+
+    static constexpr int gl_type() {
+        return GL_FLOAT;
+    }
+
+    static void set_uniform(unsigned location, const std::array<float, arr_count> &v) {
+        glUniform1fv(location, arr_count, v.data());
+    }
+
+};
 
 template<>
 struct glm_type_traits<glm::vec2>
@@ -454,7 +588,7 @@ struct glm_type_traits<glm::vec2>
 
 };
 
-template<unsigned arr_count>
+template<std::size_t arr_count>
 struct glm_type_traits<std::array<glm::vec2, arr_count> >
 {
     static constexpr unsigned size() {
@@ -466,7 +600,7 @@ struct glm_type_traits<std::array<glm::vec2, arr_count> >
     }
 
     static void set_uniform(unsigned location, const std::array<glm::vec2, arr_count> &v) {
-        glUniform3fv(location, arr_count, &v[0].x);
+        glUniform2fv(location, arr_count, &v[0].x);
     }
 
 };
@@ -489,7 +623,7 @@ struct glm_type_traits<glm::vec3>
 
 };
 
-template<unsigned arr_count>
+template<std::size_t arr_count>
 struct glm_type_traits<std::array<glm::vec3, arr_count> >
 {
     static constexpr unsigned size() {
@@ -507,6 +641,41 @@ struct glm_type_traits<std::array<glm::vec3, arr_count> >
 };
 
 
+template<>
+struct glm_type_traits<glm::vec4>
+{
+    static constexpr unsigned size() {
+        return sizeof(glm::vec4);
+    }
+
+    static constexpr int gl_type() {
+        return GL_FLOAT;
+    }
+
+    static void set_uniform(unsigned location, const glm::vec4 &v) {
+        glUniform4fv(location, 1, &v.x);
+    }
+
+};
+
+template<std::size_t arr_count>
+struct glm_type_traits<std::array<glm::vec4, arr_count> >
+{
+    static constexpr unsigned size() {
+        return sizeof(glm::vec4);
+    }
+
+    static constexpr int gl_type() {
+        return GL_FLOAT;
+    }
+
+    static void set_uniform(unsigned location, const std::array<glm::vec4, arr_count> &v) {
+        glUniform4fv(location, arr_count, &v[0].x);
+    }
+
+};
+
+
 template<>
 struct glm_type_traits<glm::mat3>
 {
@@ -541,6 +710,40 @@ struct glm_type_traits<glm::mat4>
 
 };
 
+template<std::size_t arr_count>
+struct glm_type_traits<std::array<glm::mat3, arr_count> >
+{
+    static constexpr unsigned size() {
+        return sizeof(glm::mat3);
+    }
+
+    static constexpr int gl_type() {
+        return GL_FLOAT;
+    }
+
+    static void set_uniform(unsigned location, const std::array<glm::mat3, arr_count> &v) {
+        glUniformMatrix3fv(location, arr_count, GL_FALSE, &v[0][0][0]);
+    }
+
+};
+
+template<std::size_t arr_count>
+struct glm_type_traits<std::array<glm::mat4, arr_count> >
+{
+    static constexpr unsigned size() {
+        return sizeof(glm::mat4);
+    }
+
+    static constexpr int gl_type() {
+        return GL_FLOAT;
+    }
+
+    static void set_uniform(unsigned location, const std::array<glm::mat4, arr_count> &v) {
+        glUniformMatrix4fv(location, arr_count, GL_FALSE, &v[0][0][0]);
+    }
+
+};
+
 struct program : public object
 {
     program() : object(glCreateProgram()) { }
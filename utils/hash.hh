@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace utils
+{
+
+constexpr uint64_t fnv_offset = 14695981039346656037ull;
+constexpr uint64_t fnv_prime = 1099511628211ull;
+
+// FNV-1a over 64-bit words, the tail, if any, folded in bytewise. Baked
+// terrain files store these sums, so the word order must not change.
+inline uint64_t fnv1a(const void *data, size_t length, uint64_t seed = fnv_offset) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t h = seed;
+    size_t n = length / 8;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w;
+        std::memcpy(&w, p + i * 8, 8);
+        h = (h ^ w) * fnv_prime;
+    }
+    for (size_t i = n * 8; i < length; i++)
+        h = (h ^ p[i]) * fnv_prime;
+    return h;
+}
+
+// Bytewise FNV-1a of a C string, usable in constant expressions.
+constexpr uint64_t fnv1a_string(const char *s, uint64_t h = fnv_offset) {
+    return *s ? fnv1a_string(s + 1, (h ^ static_cast<unsigned char>(*s)) * fnv_prime) : h;
+}
+
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utils
+{
+
+class thread_pool
+{
+public:
+    explicit thread_pool(unsigned workers = std::thread::hardware_concurrency()) {
+        if (workers > 1)
+            for (unsigned i = 0; i < workers - 1; i++)
+                threads.emplace_back([this] { run(); });
+    }
+
+    ~thread_pool() noexcept {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads)
+            t.join();
+    }
+
+    thread_pool(const thread_pool &) = delete;
+
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    // Number of threads taking part in parallel_for, the caller included.
+    unsigned size() const noexcept {
+        return threads.size() + 1;
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    // Calls f(lo, hi) over [begin, end) in chunks of at most grain items.
+    // The calling thread works too and returns once every chunk is done,
+    // so nested calls from inside a job cannot deadlock.
+    template<typename F>
+    void parallel_for(int begin, int end, int grain, F &&f) {
+        if (end <= begin)
+            return;
+        if (grain < 1)
+            grain = 1;
+
+        int chunks = (end - begin + grain - 1) / grain;
+        if (chunks == 1 || threads.empty()) {
+            for (int lo = begin; lo < end; lo += grain)
+                f(lo, std::min(lo + grain, end));
+            return;
+        }
+
+        struct state
+        {
+            std::atomic<int> next;
+            std::atomic<int> done;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto s = std::make_shared<state>();
+        s->next = 0;
+        s->done = 0;
+
+        auto work = [s, begin, end, grain, chunks, &f] {
+            for (int c = s->next++; c < chunks; c = s->next++) {
+                int lo = begin + c * grain;
+                f(lo, std::min(lo + grain, end));
+                if (++s->done == chunks) {
+                    std::lock_guard<std::mutex> lock(s->mutex);
+                    s->finished.notify_all();
+                }
+            }
+        };
+
+        unsigned helpers = std::min<unsigned>(threads.size(), chunks - 1);
+        for (unsigned i = 0; i < helpers; i++)
+            submit(work);
+        work();
+
+        std::unique_lock<std::mutex> lock(s->mutex);
+        s->finished.wait(lock, [&] { return s->done == chunks; });
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()> > jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping{false};
+};
+
+}